@@ -29,53 +29,91 @@ static bool isPow2(int v)
   return (n == 1);
 }
 
+//! spreads the lower 16 bits of v over the even bits
+static unsigned int part1By1(unsigned int v)
+{
+  v &= 0x0000ffff;
+  v = (v | (v << 8)) & 0x00ff00ff;
+  v = (v | (v << 4)) & 0x0f0f0f0f;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
+//! inverse of part1By1
+static unsigned int compact1By1(unsigned int v)
+{
+  v &= 0x55555555;
+  v = (v | (v >> 1)) & 0x33333333;
+  v = (v | (v >> 2)) & 0x0f0f0f0f;
+  v = (v | (v >> 4)) & 0x00ff00ff;
+  v = (v | (v >> 8)) & 0x0000ffff;
+  return v;
+}
+
 // --------------------------------------------------------------
 
-Analyzer::Analyzer(ImageBuf* ex, ImageBuf* pca)
+std::shared_ptr<const Analyzer> Analyzer::create(std::shared_ptr<const ImageBuf> ex, std::shared_ptr<const ImageBuf> pca, Layout layout)
+{
+  std::shared_ptr<Analyzer> a(new Analyzer(ex, pca, layout));
+  a->run();
+  return a;
+}
+
+// --------------------------------------------------------------
+
+Analyzer::Analyzer(std::shared_ptr<const ImageBuf> ex, std::shared_ptr<const ImageBuf> pca, Layout layout)
 {
   assert(isPow2(ex->spec().width) || ex->spec().width == ex->spec().height);
   m_Exemplar = ex;
   m_PCAExemplar = pca;
+  m_Stack = NULL;
+  // Z-order needs a square power of two domain
+  bool morton_ok = isPow2(ex->spec().width) && ex->spec().width == ex->spec().height;
+  m_Layout = (layout == LAYOUT_MORTON && morton_ok) ? LAYOUT_MORTON : LAYOUT_RASTER;
+  m_WrapMask = morton_ok ? ex->spec().width - 1 : -1;
 }
 
 // --------------------------------------------------------------
-ImageBuf* GeneratePyramid(ImageBuf* pImage)
+
+int Analyzer::cellIndex(int i,int j,int width) const
 {
-  int size_u = pImage->spec().width/2;
-  int size_v = pImage->spec().height/2;
-  int nc = pImage->spec().nchannels;
-  ImageSpec specOutput(size_u, size_v, nc, TypeDesc::FLOAT);
-  ImageBuf* pOutputBuf = new ImageBuf(specOutput);
-  ImageBufAlgo::resize(*pOutputBuf, *pImage, "", 0, ROI(0, specOutput.width, 0, specOutput.height));
-  return pOutputBuf;
+  if (m_Layout == LAYOUT_MORTON) {
+    return int(part1By1(i) | (part1By1(j) << 1));
+  }
+  return i + j * width;
 }
 
 // --------------------------------------------------------------
 
-void Analyzer::GenPyramidsEx()
+Imath::V2s Analyzer::cellCoord(int index,int width) const
 {
-  std::vector<ImageBuf*> pyramids;
-  int level_count = log2(m_PCAExemplar->spec().width);
-  pyramids.push_back(m_PCAExemplar);
-  for (int i = 0; i < level_count; ++i)
-  {
-    pyramids.push_back(GeneratePyramid(pyramids.back()));
+  if (m_Layout == LAYOUT_MORTON) {
+    return Imath::V2s(compact1By1(index), compact1By1(index >> 1));
   }
-  
-  m_Stack = new ImageStack(pyramids);
+  return Imath::V2s(index % width, index / width);
+}
+
+// --------------------------------------------------------------
+
+void Analyzer::GenStack()
+{
+  // one level per octave, down to a footprint covering the whole exemplar
+  int level_count = log2(m_PCAExemplar->spec().width) + 1;
+  m_Stack = new ImageStack(m_PCAExemplar.get(), level_count);
 }
 
 // --------------------------------------------------------------
 
 void Analyzer::run()
 {
-  GenPyramidsEx();
+  GenStack();
   // analyze stack
   analyzeStack();
 }
 
 // --------------------------------------------------------------
-void Analyzer::analyzeLevel(int level, Analyzer* theAnalyzer)
+void Analyzer::analyzeLevel(int level, const Analyzer* theAnalyzer)
 {
   ImageBuf* img = theAnalyzer->m_Stack->level(level);
   theAnalyzer->m_KNearests[level].resize( img->spec().width * img->spec().height );
@@ -86,24 +124,36 @@ void Analyzer::analyzeLevel(int level, Analyzer* theAnalyzer)
 // --------------------------------------------------------------
 void Analyzer::analyzeStack()
 {
-  // Analyzes
+  // Levels are analyzed on demand (see requestLevel): a synthesizer requests
+  // every level it will reach when it starts, so that they are analyzed side
+  // by side and overlap with synthesis, and levels that are never reached are
+  // never analyzed.
   int level_count = m_Stack->numLevels();
   m_KNearests    .resize( level_count );
   m_Neighborhoods.resize( level_count );
+  m_LevelDone    .resize( level_count );
+}
 
-//for (int i = 0; i < level_count; ++i)
-//{
-//  Analyzer::analyzeLevel(i, this); 
-//}
-  parallel_for( blocked_range<size_t>(0,level_count), 
-    [&](const blocked_range<size_t>& r) {
-      for(size_t i=r.begin(); i!=r.end(); ++i) 
-          Analyzer::analyzeLevel(i, this); 
-    }
-  );
+// --------------------------------------------------------------
+
+std::shared_future<void> Analyzer::requestLevel(int l) const
+{
+  assert(l >= 0 && l < int(m_LevelDone.size()));
+  std::lock_guard<std::mutex> lock(m_LevelLock);
+  if (!m_LevelDone[l].valid()) {
+    m_LevelDone[l] = std::async(std::launch::async, &Analyzer::analyzeLevel, l, this).share();
+  }
+  return m_LevelDone[l];
+}
+
+// --------------------------------------------------------------
+
+void Analyzer::waitLevel(int l) const
+{
+  requestLevel(l).wait();
 }
 
-void Analyzer::analyzeStackLevel(int l)
+void Analyzer::analyzeStackLevel(int l) const
 {
   int pixel_count = m_Neighborhoods[l].size();
   float* dataset_buf = new float[pixel_count * DIM * VN];
@@ -144,15 +194,15 @@ void Analyzer::analyzeStackLevel(int l)
   // do a knn search, using 128 checks
   int hr = index.knnSearch(query, indices, dists, K, *sParams);
 
+  // dataset rows follow the table layout, convert them back to coordinates
+  int width = m_Stack->level(l)->spec().width;
   for (int i = 0; i < pixel_count; ++i)
   {
     for (int j = 0; j < K; ++j)
     {
-      int sqrt_count = sqrt(pixel_count);
       if (indexs_buf[i*K + j] == -1)
         break;
-      m_KNearests[l][i].coords[j][0] = indexs_buf[i*K + j] % sqrt_count;
-      m_KNearests[l][i].coords[j][1] = indexs_buf[i*K + j] / sqrt_count;
+      m_KNearests[l][i].coords[j] = cellCoord(indexs_buf[i*K + j], width);
     }
   }
   delete indexParams;
@@ -165,7 +215,7 @@ void Analyzer::analyzeStackLevel(int l)
 
 // --------------------------------------------------------------
 
-void Analyzer::gatherNeighborhoods(int l, std::vector<Neighborhood>& _neighs)
+void Analyzer::gatherNeighborhoods(int l, std::vector<Neighborhood>& _neighs) const
 {
   ImageBuf* img = m_Stack->level(l);
   int width = img->spec().width;
@@ -175,7 +225,7 @@ void Analyzer::gatherNeighborhoods(int l, std::vector<Neighborhood>& _neighs)
   for (int j = 0; j < height; ++j) {
     for (int i = 0; i < width; ++i) {
       // extract neighborhood
-      _neighs[i + j * width] = gatherNeighborhood(l,i,j);
+      _neighs[cellIndex(i, j, width)] = gatherNeighborhood(l,i,j);
     }
   }
 }
@@ -188,16 +238,11 @@ Analyzer::Neighborhood Analyzer::gatherNeighborhood(int l,int i,int j) const
   // in a regular image, neighbors are not next to each others in the stack but
   // separated by a level-dependent offset.
   Neighborhood n;
-  ImageBuf* img = m_Stack->level(l);
-  int width = img->spec().width;
-  int height = img->spec().height;
   int          spacing = (1 << l); // level-dependent offset
   Neighborhood::ForNeighborhood([&](int di, int dj, int index)->void {
       int x  = (i + di * spacing);
       int y  = (j + dj * spacing);
-      float clr[DIM];
-      img->getpixel(x, y, clr);
-      n.setPixel(index, clr);
+      n.setPixel(index, stackPixel(l, x, y));
     }
   );
   return (n);
@@ -212,16 +257,30 @@ const Analyzer::Neighborhood& Analyzer::neighborhoodAt(int l,int i,int j) const
   ImageBuf* img = m_Stack->level(l);
   int width = img->spec().width;
   int height = img->spec().height;
-  i = ImageStack::wrapAccess(i, width);
-  j = ImageStack::wrapAccess(j, height);
-  return m_Neighborhoods[l][i + j * width];
+  return m_Neighborhoods[l][cellIndex(wrap(i, width), wrap(j, height), width)];
+}
+
+// --------------------------------------------------------------
+
+const Analyzer::KNearest& Analyzer::kNearestAt(int l,int i,int j) const
+{
+  assert(l >= 0 && l < int(m_KNearests.size()));
+  ImageBuf* img = m_Stack->level(l);
+  int width = img->spec().width;
+  int height = img->spec().height;
+  return m_KNearests[l][cellIndex(wrap(i, width), wrap(j, height), width)];
 }
 
 // --------------------------------------------------------------
 
 Analyzer::~Analyzer()
 {
-  delete m_Exemplar;
-  delete m_PCAExemplar;
+  // outstanding analyses still write into this object
+  for (size_t l = 0; l < m_LevelDone.size(); ++l) {
+    if (m_LevelDone[l].valid()) {
+      m_LevelDone[l].wait();
+    }
+  }
+  delete m_Stack;
 }
 
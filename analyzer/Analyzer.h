@@ -5,6 +5,9 @@
 #include <OpenImageIO/imagebuf.h>
 #include <OpenEXR/ImathVec.h>
 #include <vector>
+#include <memory>
+#include <future>
+#include <mutex>
 
 #include "ImageStack.h"
 
@@ -17,9 +20,27 @@ OIIO_NAMESPACE_USING
 #define M_NUM 3
 #define D_NUM 4
 
+/**
+Analysis of one exemplar: Gaussian stack, pre-gathered neighborhoods and
+k-nearest neighborhoods per stack level.
+
+An Analyzer is only handed out as std::shared_ptr<const Analyzer> (see
+create), and is read-only from then on: any number of Synthesizers, on any
+number of threads, may share it. The per-level tables are the only state
+computed after creation; they are filled lazily, once, behind a future per
+level, and never modified afterwards. The Analyzer shares ownership of the
+exemplar images it is given.
+*/
 class Analyzer
 {
 public:
+  //! memory layout of the per-pixel tables (neighborhoods and k-nearests)
+  enum Layout
+  {
+    LAYOUT_RASTER,  // row-major
+    LAYOUT_MORTON   // Z-order, keeps 2-D clusters of pixels in the same cache lines and pages
+  };
+
   class KNearest
   {
   public:
@@ -106,6 +127,12 @@ public:
       pixel[d_i*DIM + 2] = clr[2];//+
     }
 
+    //! the DIM * VN values of the neighborhood, pixel after pixel
+    const float* values() const
+    {
+      return pixel;
+    }
+
     float sqLength()
     {
       float sum = 0.0f;
@@ -116,54 +143,113 @@ public:
       return sum;
     }
   };
-  static void analyzeLevel(int level, Analyzer* theAnalyzer);
+  static void analyzeLevel(int level, const Analyzer* theAnalyzer);
 private:
   //std::string                               m_Name;          // Exemplar name
-  ImageBuf*                                              m_Exemplar;      // Exemplar image
-  ImageBuf*                                              m_PCAExemplar;
+  std::shared_ptr<const ImageBuf>         m_Exemplar;      // Exemplar image, never modified once analyzed
+  std::shared_ptr<const ImageBuf>         m_PCAExemplar;
   ImageStack*                                 m_Stack;         // Exemplar stack, computed from the image
-  std::vector<std::vector<KNearest> >     m_KNearests;     // k-most similar neighborhoods within same exemplar stack level
-  std::vector<std::vector<Neighborhood> > m_Neighborhoods; // All neighborhoods (pre-gathered for efficiency)
+  // Lazily computed per-level tables - each level is written once, by the
+  // analysis behind its m_LevelDone future, and only read after it completed
+  mutable std::vector<std::vector<KNearest> >     m_KNearests;     // k-most similar neighborhoods within same exemplar stack level
+  mutable std::vector<std::vector<Neighborhood> > m_Neighborhoods; // All neighborhoods (pre-gathered for efficiency)
+  mutable std::vector<std::shared_future<void> >  m_LevelDone;     // One future per stack level, invalid until the level is requested
+  mutable std::mutex                              m_LevelLock;     // Protects m_LevelDone
+  Layout                                  m_Layout;        // Layout of m_KNearests and m_Neighborhoods
+  int                                     m_WrapMask;      // width-1 for square power of two exemplars (wrap is a mask), -1 otherwise
   int                                                    m_NumThreads;    // Number of threads to be used
 
-  //! analyzes the exemplar stack, level per level
+  //! prepares per-level storage; no level is analyzed until requested
   void analyzeStack();
   //! analyzes one exemplar stack level
-  void analyzeStackLevel  (int l);
+  void analyzeStackLevel  (int l) const;
   //! gathers all neighborhoods of the exemplar stack level
-  void gatherNeighborhoods(int l, std::vector<Neighborhood>& _neighs);
+  void gatherNeighborhoods(int l, std::vector<Neighborhood>& _neighs) const;
   //! gathers neighborhood at i,j in the stack level l
   Neighborhood gatherNeighborhood (int l,int i,int j) const;
+  //! toroidal wrap of an exemplar coordinate
+  int          wrap               (int c,int size) const
+  {
+    return (m_WrapMask >= 0) ? (c & m_WrapMask) : int(ImageStack::wrapAccess(c, size));
+  }
+  //! index of pixel i,j (already wrapped) in the per-pixel tables of a width x width level
+  int          cellIndex          (int i,int j,int width) const;
+  //! inverse of cellIndex
+  Imath::V2s   cellCoord          (int index,int width) const;
   
-  void GenPyramidsEx();
+  //! builds the exemplar Gaussian stack
+  void GenStack();
 
-public:
-  
   /**
   Constructor - takes exemplar name and image as input
+  The Morton layout requires a square, power of two exemplar; raster is used otherwise.
   */
-  Analyzer(ImageBuf* ex, ImageBuf* pca);
-  ~Analyzer();
+  Analyzer(std::shared_ptr<const ImageBuf> ex, std::shared_ptr<const ImageBuf> pca, Layout layout);
 
   /**
   Runs analysis. Ideally the result would be saved for later reuse. In this 
   simple implementation nothing gets saved.
+  Only the exemplar stack is built here; each level is analyzed lazily, in
+  the background, the first time it is requested.
   */
   void  run();
 
+public:
+
+  /**
+  Creates and runs an analyzer. ex holds the colors used for the result,
+  pca the (possibly reduced) colors used for analysis; both may be the same
+  image. The images are shared read-only: callers hand over fully loaded
+  images and keep only const handles to them.
+  */
+  static std::shared_ptr<const Analyzer> create(std::shared_ptr<const ImageBuf> ex, std::shared_ptr<const ImageBuf> pca,
+                                                Layout layout = LAYOUT_RASTER);
+  ~Analyzer();
+  Analyzer(const Analyzer&) = delete;
+  Analyzer& operator=(const Analyzer&) = delete;
+
+  /**
+  Starts analysis of stack level l on another thread if it was not started yet,
+  and returns the future signaling its completion. Never blocks.
+  */
+  std::shared_future<void> requestLevel(int l) const;
+
+  /**
+  Blocks until stack level l is analyzed, starting its analysis if needed.
+  */
+  void  waitLevel(int l) const;
+
   /**
   Returns the neighborhood at i,j in the stack level l. This is using pre-gathered neighborhoods.
   It is meant to be called after analysis, during synthesis.
   */
   const Neighborhood& neighborhoodAt(int l, int i, int j) const;
 
+  /**
+  Returns the k-nearest neighborhoods of i,j in the stack level l.
+  Level l must have been waited for (see waitLevel).
+  */
+  const KNearest&     kNearestAt(int l, int i, int j) const;
+
+  /**
+  Returns the color of pixel i,j of stack level l, with toroidal wrap.
+  */
+  const float*        stackPixel(int l, int i, int j) const
+  {
+    int width = m_Stack->level(l)->spec().width;
+    int height = m_Stack->level(l)->spec().height;
+    return m_Stack->pixels(l) + (wrap(i, width) + wrap(j, height) * width) * DIM;
+  }
+
   /**
   Accessors
   */
 
-  const ImageBuf*                            ex()    { return (m_Exemplar);  }
-  const ImageStack*         stack() { return (m_Stack);     }
-  const std::vector<std::vector<KNearest> >& kNrst() { return (m_KNearests); }
+  const ImageBuf*                            ex()    const { return (m_Exemplar.get());  }
+  const ImageStack*                          stack() const { return (m_Stack);     }
+  //! k-nearest table of level l, stored in layout() order - waits for the level analysis
+  const std::vector<KNearest>&               kNrst(int l) const { waitLevel(l); return (m_KNearests[l]); }
+  Layout                                     layout() const { return (m_Layout); }
 };
 
-#endif // _ANALYZER_H__
\ No newline at end of file
+#endif // _ANALYZER_H__
\ No newline at end of file
@@ -2,6 +2,9 @@
 #define _IMAGESTACK_H__
 
 #include <OpenImageIO/imagebuf.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <vector>
 
 OIIO_NAMESPACE_USING
 
@@ -10,83 +13,114 @@ class ImageStack
 public:
   static unsigned int wrapAccess(int c, unsigned int size)
   {
-    int ct = c % size;
+    // signed modulo: with an unsigned size, c % size would convert c to unsigned
+    int ct = c % int(size);
     return (ct < 0) ? ct + size : ct;
   }
 private:
-  void bilinear(const ImageBuf* img, const float u, const float v, float* data) const
-  {
-    int width = img->spec().width;
-    int height = img->spec().height;
-    // translate into "Array coordinate space"
-    float i  = u * width - 0.5f;
-    float j  = v * height - 0.5f;
-
-    // get corners of interpolation cell
-    int i0   = int(floor(i));
-    int i1   = i0 + 1;
-    int j0   = int(floor(j));
-    int j1   = j0 + 1;
-
-    // apply access policy
-    i0 = wrapAccess(i0,width);
-    i1 = wrapAccess(i1,width);
-    j0 = wrapAccess(j0,height);
-    j1 = wrapAccess(j1,height);
-
-    // compute interpolation fractions
-    float fi = (i - int(floor(i)));
-    float fj = (j - int(floor(j)));
+  static const int NC   = 3;  // channels stored per level
+  static const int TAPS = 5;  // binomial kernel 1 4 6 4 1
 
-    // interpolate each component and return
-    float ij00[3], ij01[3], ij10[3], ij11[3];
-    img->getpixel(i0, j0, ij00);
-    img->getpixel(i0, j1, ij01);
-    img->getpixel(i1, j0, ij10);
-    img->getpixel(i1, j1, ij11);
-    for (int i = 0; i < 3; ++i)
-    {
-      data[i] = (1.0f-fi)*((1.0f-fj)*ij00[i]
-                + (fj)*           ij01[i])
-                + (fi)*((1.0f-fj)*ij10[i]
-                + (fj)*           ij11[i]);
+  //! filters src into dst with the binomial kernel dilated by d, separably, with wrap-around borders
+  void filterLevel(const float* src, float* dst, int width, int height, int d) const
+  {
+    static const float w[TAPS] = {1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f};
+    int row_size = width * NC;
+    std::vector<float> tmp(row_size * height);
+    // source column of each padded column, the same for every row; the apron
+    // may be wider than the row at coarse levels
+    int apron = 2 * d;
+    std::vector<int> wrapped(width + 2 * apron);
+    for (int i = -apron; i < width + apron; ++i) {
+      wrapped[i + apron] = wrapAccess(i, width);
     }
+    // horizontal pass - each row is copied with a wrapped apron so that the
+    // inner loop is a contiguous, branch-free multiply-add
+    tbb::parallel_for( tbb::blocked_range<int>(0, height),
+      [&](const tbb::blocked_range<int>& r) {
+        std::vector<float> padded((width + 2 * apron) * NC);
+        for (int j = r.begin(); j != r.end(); ++j) {
+          const float* in = src + j * row_size;
+          for (int i = 0; i < width + 2 * apron; ++i) {
+            const float* p = in + wrapped[i] * NC;
+            for (int c = 0; c < NC; ++c) padded[i * NC + c] = p[c];
+          }
+          float* out = &tmp[j * row_size];
+          for (int x = 0; x < row_size; ++x) out[x] = 0.0f;
+          for (int k = 0; k < TAPS; ++k) {
+            const float* tap = &padded[k * d * NC];
+            for (int x = 0; x < row_size; ++x) out[x] += w[k] * tap[x];
+          }
+        }
+      }
+    );
+    // vertical pass - whole rows are combined at once
+    tbb::parallel_for( tbb::blocked_range<int>(0, height),
+      [&](const tbb::blocked_range<int>& r) {
+        for (int j = r.begin(); j != r.end(); ++j) {
+          float* out = dst + j * row_size;
+          for (int x = 0; x < row_size; ++x) out[x] = 0.0f;
+          for (int k = 0; k < TAPS; ++k) {
+            const float* tap = &tmp[wrapAccess(j + (k - TAPS/2) * d, height) * row_size];
+            for (int x = 0; x < row_size; ++x) out[x] += w[k] * tap[x];
+          }
+        }
+      }
+    );
   }
 
-
 protected:
 
-  std::vector<ImageBuf*> m_Levels;
+  std::vector<ImageBuf*>          m_Levels;
+  std::vector<std::vector<float> > m_Pixels;  // Level storage, wrapped by m_Levels
 
 public:
 
   ImageStack(uint l) { m_Levels.resize(l); }
-  ImageStack(std::vector<ImageBuf*> pyr)
+
+  /**
+  Builds a Gaussian stack of l levels from img. Level 0 is img itself, level
+  n is level n-1 filtered with a binomial kernel dilated by 2^(n-1), so every
+  level keeps the full resolution of img.
+  */
+  ImageStack(const ImageBuf* img, uint l)
   {
-    m_Levels.resize( pyr.size() );
-    for (int l = 0; l < m_Levels.size(); ++l)
-    {
-      int width = pyr[0]->spec().width;
-      int height = pyr[0]->spec().height;
-      int nc = pyr[0]->spec().nchannels;
-      ImageSpec specOutput(width, height, nc, TypeDesc::FLOAT);
-      m_Levels[l] = new ImageBuf(specOutput);
-      for (int i = 0; i < width; ++i)
-        for (int j = 0; j < height; ++j)
-      {
-        float fi = (i+0.5f) / float(width);
-        float fj = (j+0.5f) / float(height);
-        float clr[3];
-        bilinear(pyr[l], fi, fj, clr);
-        m_Levels[l]->setpixel(i , j, clr);
+    int width  = img->spec().width;
+    int height = img->spec().height;
+    ImageSpec specOutput(width, height, NC, TypeDesc::FLOAT);
+    m_Levels.resize(l);
+    m_Pixels.resize(l);
+    for (uint n = 0; n < l; ++n) {
+      m_Pixels[n].resize(width * height * NC);
+      m_Levels[n] = new ImageBuf("stack", specOutput, &m_Pixels[n][0]);
+    }
+    float* base = &m_Pixels[0][0];
+    for (int j = 0; j < height; ++j) {
+      for (int i = 0; i < width; ++i) {
+        img->getpixel(i, j, base + (i + j * width) * NC, NC);
       }
     }
+    for (uint n = 1; n < l; ++n) {
+      filterLevel(&m_Pixels[n-1][0], &m_Pixels[n][0], width, height, 1 << (n-1));
+    }
+  }
+
+  ~ImageStack()
+  {
+    for (size_t n = 0; n < m_Levels.size(); ++n) {
+      delete m_Levels[n];
+    }
   }
+  // levels are owned, a copy would delete them twice
+  ImageStack(const ImageStack&) = delete;
+  ImageStack& operator=(const ImageStack&) = delete;
 
   unsigned int numLevels() const {return m_Levels.size();}
 
   //! Accessors to single Level 
   const ImageBuf* level(const unsigned int l) const { return m_Levels[l];}
+  //! raw RGB float storage of a level, row-major
+  const float*    pixels(const unsigned int l) const { return &m_Pixels[l][0];}
   ImageBuf*       level(const unsigned int l)       { return m_Levels[l];}
 };
 
@@ -0,0 +1,170 @@
+#include <new>
+#include <memory>
+#include <cmath>
+#include <stdint.h>
+
+#include "texsyn.h"
+#include "../synthesizer/Synthesizer.h"
+
+// --------------------------------------------------------------
+
+struct texsyn_analyzer
+{
+  std::shared_ptr<const Analyzer> analyzer;
+};
+
+struct texsyn_synthesizer
+{
+  std::shared_ptr<const Analyzer> analyzer;      // keeps the analysis alive
+  Synthesizer*                    synthesizer;   // NULL until the first synthesis
+};
+
+//! simple function to check that a number is a power of two
+static bool isPow2(int v)
+{
+  return v > 0 && (v & (v - 1)) == 0;
+}
+
+// --------------------------------------------------------------
+
+int texsyn_api_version(void)
+{
+  return TEXSYN_API_VERSION;
+}
+
+// --------------------------------------------------------------
+
+texsyn_analyzer* texsyn_analyzer_create(const float* pixels, int width, int height, int nchannels)
+{
+  // synthesized coordinates are 16-bit signed, and the pixel array must be addressable
+  if (pixels == NULL || width != height || !isPow2(width) || width < 2 || width > 32768 || nchannels < 3
+      || size_t(width) * size_t(height) > SIZE_MAX / size_t(nchannels)) {
+    return NULL;
+  }
+  try {
+    ImageSpec spec(width, height, 3, TypeDesc::FLOAT);
+    std::shared_ptr<ImageBuf> ex(new ImageBuf(spec));
+    for (int j = 0; j < height; ++j) {
+      for (int i = 0; i < width; ++i) {
+        ex->setpixel(i, j, pixels + (size_t(i) + size_t(j) * width) * nchannels, 3);
+      }
+    }
+    std::unique_ptr<texsyn_analyzer> a(new texsyn_analyzer);
+    a->analyzer = Analyzer::create(ex, ex);
+    return a.release();
+  } catch (...) {
+    return NULL;
+  }
+}
+
+// --------------------------------------------------------------
+
+void texsyn_analyzer_destroy(texsyn_analyzer* a)
+{
+  delete a;
+}
+
+// --------------------------------------------------------------
+
+texsyn_synthesizer* texsyn_synthesizer_create(texsyn_analyzer* a)
+{
+  if (a == NULL) return NULL;
+  texsyn_synthesizer* s = new (std::nothrow) texsyn_synthesizer;
+  if (s == NULL) return NULL;
+  s->analyzer    = a->analyzer;
+  s->synthesizer = NULL;
+  return s;
+}
+
+// --------------------------------------------------------------
+
+void texsyn_synthesizer_destroy(texsyn_synthesizer* s)
+{
+  if (s == NULL) return;
+  delete s->synthesizer;
+  delete s;
+}
+
+// --------------------------------------------------------------
+
+texsyn_status texsyn_synthesize(texsyn_synthesizer* s, int width, int height,
+                                float jitter, float kappa, int subpasslevel, unsigned int seed)
+{
+  // written so that NaN fails too, as the Synthesizer asserts on it
+  if (s == NULL || width <= 0 || height <= 0 || !(kappa > 0.0f) || !std::isfinite(jitter) || subpasslevel < 1) {
+    return TEXSYN_ERR_ARGUMENT;
+  }
+  try {
+    // a Synthesizer runs once, start from a fresh one
+    delete s->synthesizer;
+    s->synthesizer = NULL;
+    // owned here until synthesis succeeds
+    std::unique_ptr<Synthesizer> synthesizer(new Synthesizer(s->analyzer));
+    synthesizer->setRetainedLevels(1);
+    synthesizer->init(width, height, jitter, kappa, subpasslevel, seed);
+    while (!synthesizer->done()) {
+      synthesizer->synthesizeNextLevel();
+    }
+    s->synthesizer = synthesizer.release();
+    return TEXSYN_OK;
+  } catch (...) {
+    return TEXSYN_ERR_INTERNAL;
+  }
+}
+
+// --------------------------------------------------------------
+
+texsyn_status texsyn_result_size(const texsyn_synthesizer* s, int* width, int* height)
+{
+  if (s == NULL || width == NULL || height == NULL) return TEXSYN_ERR_ARGUMENT;
+  if (s->synthesizer == NULL) return TEXSYN_ERR_STATE;
+  const Synthesizer::SynthesisData& coords = s->synthesizer->resultCoords();
+  *width  = Synthesizer::columnsOf(coords);
+  *height = Synthesizer::rowsOf(coords);
+  return TEXSYN_OK;
+}
+
+// --------------------------------------------------------------
+
+texsyn_status texsyn_result_coords(const texsyn_synthesizer* s, short* out, size_t count)
+{
+  if (s == NULL || out == NULL) return TEXSYN_ERR_ARGUMENT;
+  if (s->synthesizer == NULL) return TEXSYN_ERR_STATE;
+  const Synthesizer::SynthesisData& coords = s->synthesizer->resultCoords();
+  int row    = Synthesizer::rowsOf(coords);
+  int column = Synthesizer::columnsOf(coords);
+  if (count < size_t(row) * column * 2) return TEXSYN_ERR_BUFFER;
+  int width  = s->analyzer->ex()->spec().width;
+  for (int j = 0; j < row; ++j) {
+    for (int i = 0; i < column; ++i) {
+      Imath::V2s xy = coords[j][i];
+      *out++ = ImageStack::wrapAccess(xy[0], width);
+      *out++ = ImageStack::wrapAccess(xy[1], width);
+    }
+  }
+  return TEXSYN_OK;
+}
+
+// --------------------------------------------------------------
+
+texsyn_status texsyn_result_colors(texsyn_synthesizer* s, float* out, size_t count)
+{
+  if (s == NULL || out == NULL) return TEXSYN_ERR_ARGUMENT;
+  if (s->synthesizer == NULL) return TEXSYN_ERR_STATE;
+  const Synthesizer::SynthesisData& coords = s->synthesizer->resultCoords();
+  int row    = Synthesizer::rowsOf(coords);
+  int column = Synthesizer::columnsOf(coords);
+  if (count < size_t(row) * column * 3) return TEXSYN_ERR_BUFFER;
+  try {
+    ImageBuf* img = s->synthesizer->result();
+    for (int j = 0; j < row; ++j) {
+      for (int i = 0; i < column; ++i) {
+        img->getpixel(i, j, out + (i + j * column) * 3, 3);
+      }
+    }
+    delete img;
+    return TEXSYN_OK;
+  } catch (...) {
+    return TEXSYN_ERR_INTERNAL;
+  }
+}
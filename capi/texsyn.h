@@ -0,0 +1,78 @@
+#ifndef _TEXSYN_H__
+#define _TEXSYN_H__
+
+/*
+  C interface of libtexsyn, for in-process synthesis without file I/O.
+
+  Typical use:
+    texsyn_analyzer*    a = texsyn_analyzer_create(pixels, 256, 256, 3);
+    texsyn_synthesizer* s = texsyn_synthesizer_create(a);
+    texsyn_synthesize(s, 512, 512, 25.0f, 0.2f, 2, 1);
+    texsyn_result_size(s, &w, &h);
+    texsyn_result_colors(s, rgb, w * h * 3);
+    texsyn_synthesizer_destroy(s);
+    texsyn_analyzer_destroy(a);
+
+  Synthesizers share the analysis of their analyzer, which may be destroyed
+  before them. One analyzer may be used by synthesizers running on different
+  threads concurrently; a single synthesizer handle must not be used from two
+  threads at once.
+*/
+
+#include <stddef.h>
+
+#if defined(_WIN32)
+#  define TEXSYN_API __declspec(dllexport)
+#else
+#  define TEXSYN_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TEXSYN_API_VERSION 1
+
+typedef enum
+{
+  TEXSYN_OK           = 0,
+  TEXSYN_ERR_ARGUMENT = 1,   /* invalid handle, size or parameter */
+  TEXSYN_ERR_BUFFER   = 2,   /* caller buffer too small */
+  TEXSYN_ERR_STATE    = 3,   /* no synthesis result yet */
+  TEXSYN_ERR_INTERNAL = 4
+} texsyn_status;
+
+typedef struct texsyn_analyzer    texsyn_analyzer;
+typedef struct texsyn_synthesizer texsyn_synthesizer;
+
+/* returns TEXSYN_API_VERSION of the library */
+TEXSYN_API int                 texsyn_api_version(void);
+
+/* Analyzes an exemplar given as row-major float pixels with nchannels >= 3
+   interleaved channels (only the first three are used). The exemplar must be
+   square with a power of two size, at most 32768. Pixels are copied. Returns
+   NULL on error. */
+TEXSYN_API texsyn_analyzer*    texsyn_analyzer_create(const float* pixels, int width, int height, int nchannels);
+TEXSYN_API void                texsyn_analyzer_destroy(texsyn_analyzer* a);
+
+TEXSYN_API texsyn_synthesizer* texsyn_synthesizer_create(texsyn_analyzer* a);
+TEXSYN_API void                texsyn_synthesizer_destroy(texsyn_synthesizer* s);
+
+/* Runs a full synthesis of at least width x height pixels. */
+TEXSYN_API texsyn_status       texsyn_synthesize(texsyn_synthesizer* s, int width, int height,
+                                                 float jitter, float kappa, int subpasslevel, unsigned int seed);
+
+/* Resolution of the last result. */
+TEXSYN_API texsyn_status       texsyn_result_size(const texsyn_synthesizer* s, int* width, int* height);
+
+/* Copies the last result into a caller buffer of 'count' elements:
+   - coordinates: 2 shorts per pixel, exemplar pixel coordinates
+   - colors:      3 floats per pixel, RGB */
+TEXSYN_API texsyn_status       texsyn_result_coords(const texsyn_synthesizer* s, short* coords, size_t count);
+TEXSYN_API texsyn_status       texsyn_result_colors(texsyn_synthesizer* s, float* rgb, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _TEXSYN_H__ */
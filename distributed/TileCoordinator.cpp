@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <OpenImageIO/imageio.h>
+
+#include "TileCoordinator.h"
+#include "../server/SocketIO.h"
+
+OIIO_NAMESPACE_USING
+using namespace std;
+
+// --------------------------------------------------------------
+
+// messages from a worker to the coordinator
+static const char MsgSum  = 'S';  // long long value, answered with the long long sum over all workers
+static const char MsgBand = 'B';  // int level rows, first row, rows, columns; then rows x columns coordinates
+
+// --------------------------------------------------------------
+
+/**
+Halo exchange of a worker, over its sockets to the previous and next bands of
+the ring and to the coordinator. A transport failure terminates the worker.
+*/
+class SocketHaloExchange : public HaloExchange
+{
+private:
+  int m_Control;
+  int m_Prev;
+  int m_Next;
+
+  static void sendRows(int fd, const Synthesizer::SynthesisData& band, int from)
+  {
+    int column = Synthesizer::columnsOf(band);
+    for (int j = from; j < from + Synthesizer::Apron; ++j) {
+      if (!writeAll(fd, &band[j][0], column * sizeof(Imath::V2s))) _exit(1);
+    }
+  }
+
+  static void receiveRows(int fd, Synthesizer::SynthesisData& band, int from)
+  {
+    int column = Synthesizer::columnsOf(band);
+    for (int j = from; j < from + Synthesizer::Apron; ++j) {
+      if (!readAll(fd, &band[j][0], column * sizeof(Imath::V2s))) _exit(1);
+    }
+  }
+
+public:
+  SocketHaloExchange(int control, int prev, int next) : m_Control(control), m_Prev(prev), m_Next(next) {}
+
+  virtual void exchange(Synthesizer::SynthesisData& band)
+  {
+    int first = Synthesizer::firstRowOf(band);
+    int end   = first + Synthesizer::rowsOf(band);
+    // every worker sends to its next band first and receives from its previous
+    // band first, so the ring cannot wait on itself whatever the socket buffer
+    // size; sent and received rows are disjoint (a band has at least Apron rows)
+    std::thread sender([&]() {
+      sendRows(m_Next, band, end - Synthesizer::Apron);
+      sendRows(m_Prev, band, first);
+    });
+    receiveRows(m_Prev, band, first - Synthesizer::Apron);
+    receiveRows(m_Next, band, end);
+    sender.join();
+  }
+
+  virtual long long sum(long long value)
+  {
+    long long total;
+    if (!writeAll(m_Control, &MsgSum, 1) || !writeAll(m_Control, &value, sizeof(long long))
+        || !readAll(m_Control, &total, sizeof(long long))) {
+      _exit(1);
+    }
+    return total;
+  }
+};
+
+// --------------------------------------------------------------
+
+TileCoordinator::TileCoordinator(const Params& params, int workers) : m_Params(params), m_Workers(workers), m_Columns(0)
+{
+  assert(workers >= 1);
+}
+
+// --------------------------------------------------------------
+
+bool TileCoordinator::run(const std::string& filename)
+{
+  assert(m_Pids.empty());
+  // control[2w] is the coordinator end of worker w, control[2w+1] its own;
+  // ring[2w] is the next end of worker w, ring[2w+1] the prev end of worker w+1
+  std::vector<int> control(2 * m_Workers, -1);
+  std::vector<int> ring(2 * m_Workers, -1);
+  bool ok = true;
+  for (int w = 0; ok && w < m_Workers; ++w) {
+    ok = socketpair(AF_UNIX, SOCK_STREAM, 0, &control[2 * w]) == 0;
+    if (ok && m_Workers > 1) {
+      ok = socketpair(AF_UNIX, SOCK_STREAM, 0, &ring[2 * w]) == 0;
+    }
+  }
+  for (int w = 0; ok && w < m_Workers; ++w) {
+    int pid = fork();
+    if (pid == 0) {
+      int own  = control[2 * w + 1];
+      int prev = ring[2 * ((w + m_Workers - 1) % m_Workers) + 1];
+      int next = ring[2 * w];
+      // keep only the sockets of this worker
+      for (size_t f = 0; f < control.size(); ++f) {
+        if (control[f] >= 0 && control[f] != own) close(control[f]);
+      }
+      for (size_t f = 0; f < ring.size(); ++f) {
+        if (ring[f] >= 0 && ring[f] != prev && ring[f] != next) close(ring[f]);
+      }
+      runWorker(w, own, prev, next);
+    }
+    if (pid < 0) {
+      ok = false;
+      break;
+    }
+    m_Pids.push_back(pid);
+  }
+  // the coordinator keeps only its ends of the control sockets
+  for (size_t f = 0; f < ring.size(); ++f) {
+    if (ring[f] >= 0) close(ring[f]);
+  }
+  for (int w = 0; w < m_Workers; ++w) {
+    if (control[2 * w + 1] >= 0) close(control[2 * w + 1]);
+    m_Control.push_back(control[2 * w]);
+  }
+
+  if (ok) {
+    ok = stitch(filename);
+  }
+
+  // workers still waiting on a failed run see their sockets close and exit
+  for (size_t w = 0; w < m_Control.size(); ++w) {
+    if (m_Control[w] >= 0) close(m_Control[w]);
+  }
+  m_Control.clear();
+  for (size_t w = 0; w < m_Pids.size(); ++w) {
+    int status = 0;
+    waitpid(m_Pids[w], &status, 0);
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  }
+  m_Pids.clear();
+
+  // the workers are gone, this process may now run threads of its own
+  if (ok && m_Params.verify) {
+    ok = verify();
+  }
+  m_Stitched.clear();
+  return ok;
+}
+
+// --------------------------------------------------------------
+
+void TileCoordinator::synthesize(Synthesizer& synthesizer) const
+{
+  synthesizer.init(m_Params.width, m_Params.height, m_Params.jitter, m_Params.kappa, m_Params.subpass, m_Params.seed);
+  synthesizer.setCorrectionPasses(m_Params.changeThreshold, m_Params.minPasses, m_Params.maxPasses);
+  // a level is only read while upsampling the next one
+  synthesizer.setRetainedLevels(1);
+  while (!synthesizer.done()) {
+    synthesizer.synthesizeNextLevel();
+  }
+}
+
+// --------------------------------------------------------------
+
+bool TileCoordinator::verify() const
+{
+  std::shared_ptr<ImageBuf> ex(new ImageBuf(m_Params.exemplar));
+  if (!ex->read(0, 0, true, TypeDesc::FLOAT)) {
+    return false;
+  }
+  Synthesizer synthesizer(Analyzer::create(ex, ex));
+  synthesize(synthesizer);
+  const Synthesizer::SynthesisData& coords = synthesizer.resultCoords();
+  int row    = Synthesizer::rowsOf(coords);
+  int column = Synthesizer::columnsOf(coords);
+  if (column != m_Columns || size_t(row) * column != m_Stitched.size()) {
+    fprintf(stderr, "texsyn: distributed result is %dx%d, single-process result %dx%d\n",
+            m_Columns, m_Columns > 0 ? int(m_Stitched.size() / m_Columns) : 0, column, row);
+    return false;
+  }
+  long long differ = 0;
+  for (int j = 0; j < row; ++j) {
+    for (int i = 0; i < column; ++i) {
+      differ += (coords[j][i] != m_Stitched[size_t(j) * column + i]) ? 1 : 0;
+    }
+  }
+  if (differ > 0) {
+    fprintf(stderr, "texsyn: distributed result differs from the single-process one at %lld pixels\n", differ);
+  }
+  return differ == 0;
+}
+
+// --------------------------------------------------------------
+
+void TileCoordinator::runWorker(int band, int control, int prev, int next)
+{
+  std::shared_ptr<ImageBuf> ex(new ImageBuf(m_Params.exemplar));
+  if (!ex->read(0, 0, true, TypeDesc::FLOAT)) {
+    _exit(1);
+  }
+  SocketHaloExchange exchange(control, prev, next);
+  Synthesizer synthesizer(Analyzer::create(ex, ex));
+  synthesizer.setBand(band, m_Workers, &exchange);
+  synthesize(synthesizer);
+
+  const Synthesizer::SynthesisData& coords = synthesizer.resultCoords();
+  int header[4] = { synthesizer.levelRows(), Synthesizer::firstRowOf(coords), Synthesizer::rowsOf(coords), Synthesizer::columnsOf(coords) };
+  bool ok = writeAll(control, &MsgBand, 1) && writeAll(control, header, sizeof(header));
+  for (int j = header[1]; ok && j < header[1] + header[2]; ++j) {
+    ok = writeAll(control, &coords[j][0], header[3] * sizeof(Imath::V2s));
+  }
+  _exit(ok ? 0 : 1);
+}
+
+// --------------------------------------------------------------
+
+bool TileCoordinator::stitch(const std::string& filename)
+{
+  // the coordinator only reads the exemplar to colorize the bands
+  ImageBuf ex(m_Params.exemplar);
+  if (!ex.read(0, 0, true, TypeDesc::FLOAT)) {
+    return false;
+  }
+  int width  = ex.spec().width;
+  int height = ex.spec().height;
+
+  ImageOutput* out = NULL;
+  bool ok = true;
+  bool done = false;
+  while (ok && !done) {
+    // all workers send the same sequence of messages
+    char type = 0;
+    for (int w = 0; ok && w < m_Workers; ++w) {
+      char t;
+      ok = readAll(m_Control[w], &t, 1) && (w == 0 || t == type);
+      type = t;
+    }
+    if (!ok) break;
+
+    if (type == MsgSum) {
+      long long total = 0;
+      for (int w = 0; ok && w < m_Workers; ++w) {
+        long long value;
+        ok = readAll(m_Control[w], &value, sizeof(long long));
+        total += value;
+      }
+      for (int w = 0; ok && w < m_Workers; ++w) {
+        ok = writeAll(m_Control[w], &total, sizeof(long long));
+      }
+    } else if (type == MsgBand) {
+      // bands arrive in row order; a level too small to be split is sent
+      // whole by every worker, and written once
+      int written = 0;
+      int rows    = 0;
+      for (int w = 0; ok && w < m_Workers; ++w) {
+        int header[4];
+        ok = readAll(m_Control[w], header, sizeof(header));
+        if (!ok) break;
+        int first = header[1], row = header[2], column = header[3];
+        rows = header[0];
+        if (out == NULL) {
+          out = ImageOutput::create(filename);
+          ok = out != NULL && out->open(filename, ImageSpec(column, rows, 3, TypeDesc::UINT8));
+          if (m_Params.verify) {
+            m_Columns = column;
+            m_Stitched.assign(size_t(rows) * column, Imath::V2s(0, 0));
+          }
+        }
+        std::vector<Imath::V2s> coords(column);
+        std::vector<float>      scanline(column * 3);
+        for (int j = first; ok && j < first + row; ++j) {
+          ok = readAll(m_Control[w], &coords[0], column * sizeof(Imath::V2s));
+          if (!ok || j != written) continue;
+          if (m_Params.verify) {
+            std::copy(coords.begin(), coords.end(), m_Stitched.begin() + size_t(j) * column);
+          }
+          for (int i = 0; i < column; ++i) {
+            ex.getpixel(ImageStack::wrapAccess(coords[i][0], width), ImageStack::wrapAccess(coords[i][1], height), &scanline[i * 3]);
+          }
+          ok = out->write_scanline(j, 0, TypeDesc::FLOAT, &scanline[0]);
+          written ++;
+        }
+      }
+      ok = ok && written == rows;
+      done = true;
+    } else {
+      ok = false;
+    }
+  }
+  if (out != NULL) {
+    ok = out->close() && ok;
+    delete out;
+  }
+  return ok;
+}
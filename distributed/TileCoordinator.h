@@ -0,0 +1,74 @@
+#ifndef _TILECOORDINATOR_H__
+#define _TILECOORDINATOR_H__
+
+#include <string>
+#include <vector>
+
+#include "../synthesizer/Synthesizer.h"
+
+/**
+Multi-process synthesis of domains too large for the memory of one process.
+
+The coordinator forks one worker process per band of rows. Each worker loads
+and analyzes the exemplar, then synthesizes only its band of every level (see
+Synthesizer::setBand). Workers are connected in a ring of local socket pairs,
+over which the Apron rows of each band are exchanged after every sub-pass,
+and to the coordinator, which sums the pixel changes of every correction pass
+and stitches the finished bands. Bands are colorized and streamed to the
+output file one row at a time, so that no process ever holds the whole result.
+
+The result is identical to a single-process synthesis with the same
+parameters; Params::verify checks it, at the cost of keeping the whole
+coordinate field and running that synthesis in the coordinator. A worker
+that fails exits; its neighbors then fail on the exchange, and run()
+reports the failure.
+*/
+class TileCoordinator
+{
+public:
+  //! synthesis parameters, shared by all workers
+  struct Params
+  {
+    std::string  exemplar;
+    int          width, height;     // synthesis domain
+    float        jitter;
+    float        kappa;
+    int          subpass;
+    unsigned int seed;
+    float        changeThreshold;   // see Synthesizer::setCorrectionPasses
+    int          minPasses;
+    int          maxPasses;
+    bool         verify;            // compare the stitched coordinates with a single-process synthesis
+  };
+
+private:
+  Params                                  m_Params;
+  int                                     m_Workers;       // number of worker processes, and of bands
+  std::vector<int>                        m_Pids;
+  std::vector<int>                        m_Control;       // coordinator end of the socket to each worker
+  std::vector<Imath::V2s>                 m_Stitched;      // stitched coordinates, row-major, kept only to verify
+  int                                     m_Columns;
+
+  //! runs the whole synthesis, or the band set up in synthesizer
+  void         synthesize(Synthesizer& synthesizer) const;
+  //! synthesizes band 'band' in a forked worker; never returns
+  void         runWorker(int band, int control, int prev, int next);
+  //! relays the pass sums, then writes the bands to filename as they arrive
+  bool         stitch(const std::string& filename);
+  //! runs the synthesis in this process and compares it with m_Stitched
+  bool         verify() const;
+
+public:
+  TileCoordinator(const Params& params, int workers);
+
+  /**
+  Forks the workers, synthesizes and writes the colorized result to filename.
+  Must be called before any thread is started in this process (the workers
+  are forked). Returns false if a worker failed, the output could not be
+  written, or (with Params::verify) the result differs from a single-process
+  synthesis.
+  */
+  bool         run(const std::string& filename);
+};
+
+#endif // _TILECOORDINATOR_H__
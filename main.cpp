@@ -1,10 +1,18 @@
 #include <iostream>
 #include <ctime>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
 #include <OpenImageIO/imagebuf.h>
+#include <OpenImageIO/imageio.h>
 //#include <pca.h>
 // --------------------------------------------------------------
 // --------------------------------------------------------------
+#include "server/SynthesisServer.h"
+#include "distributed/TileCoordinator.h"
+#include "synthesizer/BudgetTuner.h"
+#include "synthesizer/CoordinateMap.h"
 #include "synthesizer/Synthesizer.h"
 #include "analyzer/Analyzer.h"
 
@@ -81,31 +89,295 @@ using namespace std;
 //    return pOutBuf_2;
 //}
 
+// --------------------------------------------------------------
+
+//! writes a mip chain (finest first) as a single tiled, mip-mapped file (EXR or TX)
+static bool saveMipChain(const std::vector<ImageBuf*>& chain, const std::string& filename)
+{
+  ImageOutput* out = ImageOutput::create(filename);
+  if (!out) {
+    return false;
+  }
+  bool ok = out->supports("tiles") && out->supports("mipmap");
+  for (size_t m = 0; ok && m < chain.size(); ++m) {
+    ImageSpec spec(chain[m]->spec().width, chain[m]->spec().height, 3, TypeDesc::HALF);
+    spec.tile_width  = 64;
+    spec.tile_height = 64;
+    spec.tile_depth  = 1;
+    // synthesis results are toroidal
+    spec.attribute("wrapmodes", "periodic,periodic");
+    spec.attribute("textureformat", "Plain Texture");
+    ok = out->open(filename, spec, m == 0 ? ImageOutput::Create : ImageOutput::AppendMIPLevel);
+    if (!ok) break;
+    std::vector<float> pixels(spec.width * spec.height * 3);
+    for (int j = 0; j < spec.height; ++j) {
+      for (int i = 0; i < spec.width; ++i) {
+        chain[m]->getpixel(i, j, &pixels[(i + j * spec.width) * 3]);
+      }
+    }
+    ok = out->write_image(TypeDesc::FLOAT, &pixels[0]);
+  }
+  out->close();
+  delete out;
+  return ok;
+}
+
+// --------------------------------------------------------------
+
+//! times the correction passes of the finest synthesis step with both table
+//! layouts; analysis is completed up front and excluded, best of 'runs'
+static void benchLayouts(std::shared_ptr<const ImageBuf> ex, int size, int runs)
+{
+  const Analyzer::Layout layouts[2] = { Analyzer::LAYOUT_RASTER, Analyzer::LAYOUT_MORTON };
+  const char*            names[2]   = { "raster", "morton" };
+  const int              passes     = 2;
+  for (int k = 0; k < 2; ++k) {
+    std::shared_ptr<const Analyzer> analyzer = Analyzer::create(ex, ex, layouts[k]);
+    for (int l = 0; l < int(analyzer->stack()->numLevels()); ++l) {
+      analyzer->requestLevel(l);
+      analyzer->waitLevel(l);
+    }
+    double best = 0.0;
+    for (int r = 0; r < runs; ++r) {
+      Synthesizer synthesizer(analyzer);
+      synthesizer.init(size, size, 25.0f, 0.2f, 2);
+      synthesizer.setCorrectionPasses(0.0f, passes, passes);
+      synthesizer.setRetainedLevels(1);
+      double finest = 0.0;
+      while (!synthesizer.done()) {
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        synthesizer.synthesizeNextLevel();
+        finest = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+      }
+      best = (r == 0) ? finest : std::min(best, finest);
+    }
+    cout << names[k] << ": " << best / passes << " ms per correction pass at " << size << "x" << size
+         << " (" << ex->spec().width << "x" << ex->spec().height << " exemplar)" << endl;
+  }
+}
+
+// --------------------------------------------------------------
+
+//! times the correction passes of the finest synthesis step with the batched
+//! and the per-pixel kernels, and checks that both give the same coordinates;
+//! analysis is completed up front and excluded, best of 'runs'
+static void benchKernels(std::shared_ptr<const ImageBuf> ex, int size, int runs)
+{
+  const char* names[2] = { "per-pixel", "batched" };
+  const int   passes   = 2;
+  std::shared_ptr<const Analyzer> analyzer = Analyzer::create(ex, ex);
+  for (int l = 0; l < int(analyzer->stack()->numLevels()); ++l) {
+    analyzer->requestLevel(l);
+    analyzer->waitLevel(l);
+  }
+  std::vector<Imath::V2s> coords[2];
+  for (int k = 0; k < 2; ++k) {
+    double best = 0.0;
+    for (int r = 0; r < runs; ++r) {
+      Synthesizer synthesizer(analyzer);
+      synthesizer.setBatchedCorrection(k == 1);
+      synthesizer.init(size, size, 25.0f, 0.2f, 2);
+      synthesizer.setCorrectionPasses(0.0f, passes, passes);
+      synthesizer.setRetainedLevels(1);
+      double finest = 0.0;
+      while (!synthesizer.done()) {
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        synthesizer.synthesizeNextLevel();
+        finest = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+      }
+      best = (r == 0) ? finest : std::min(best, finest);
+      const Synthesizer::SynthesisData& c = synthesizer.resultCoords();
+      coords[k].clear();
+      for (int j = 0; j < Synthesizer::rowsOf(c); ++j) {
+        coords[k].insert(coords[k].end(), &c[j][0], &c[j][0] + Synthesizer::columnsOf(c));
+      }
+    }
+    cout << names[k] << ": " << best / passes << " ms per correction pass at " << size << "x" << size
+         << " (" << ex->spec().width << "x" << ex->spec().height << " exemplar)" << endl;
+  }
+  cout << "results " << (coords[0] == coords[1] ? "identical" : "DIFFER") << endl;
+}
+
+// --------------------------------------------------------------
+
 int main(int argc, char **argv)
 {
   int s = 0;
 
+  // daemon mode: texsyn --serve <socket path | tcp port> [cache size] [max running] [max queued]
+  if (argc >= 3 && strcmp(argv[1], "--serve") == 0) {
+    SynthesisServer server(argv[2],
+                           argc > 3 ? atoi(argv[3]) : 4,
+                           argc > 4 ? atoi(argv[4]) : 2,
+                           argc > 5 ? atoi(argv[5]) : 16);
+    if (!server.run()) {
+      cerr << "cannot listen on " << argv[2] << endl;
+      return (1);
+    }
+    return (0);
+  }
+
+  // distributed mode: texsyn --workers <n> <size> <output> [--verify] [exemplar]
+  // n worker processes synthesize a size x size texture, each holding a band of it;
+  // --verify also runs the synthesis in a single process and compares the two
+  if (argc >= 5 && strcmp(argv[1], "--workers") == 0) {
+    TileCoordinator::Params params;
+    int a = 5;
+    params.verify          = (argc > a && strcmp(argv[a], "--verify") == 0);
+    if (params.verify) ++a;
+    params.exemplar        = argc > a ? argv[a] : "TestData/stone3_exemplar.png";
+    params.width           = atoi(argv[3]);
+    params.height          = atoi(argv[3]);
+    params.jitter          = 25.0f;
+    params.kappa           = 0.2f;
+    params.subpass         = 2;
+    params.seed            = 1;
+    params.changeThreshold = 0.01f;
+    params.minPasses       = 1;
+    params.maxPasses       = 6;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    TileCoordinator coordinator(params, atoi(argv[2]));
+    if (!coordinator.run(argv[4])) {
+      cerr << "distributed synthesis failed" << endl;
+      return (1);
+    }
+    cout << "distributed synthesis: " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+         << " ms (" << argv[2] << " workers)" << endl;
+    if (params.verify) {
+      cout << "verified: identical to a single-process synthesis" << endl;
+    }
+    return (0);
+  }
+
+  // texsyn [--morton] [--mip <file.exr|file.tx>] [--coords <file.tif>] [--budget <ms>]
+  //        [--frames <n> [--flow <dx> <dy>]] [--bench-layout <size>] [--bench-kernel <size>] [exemplar]
+  std::string      exemplar = "TestData/stone3_exemplar.png";
+  std::string      mipfile;
+  std::string      coordfile;
+  double           budget   = 0.0;
+  int              bench    = 0;
+  int              benchKernel = 0;
+  int              frames   = 1;
+  Imath::V2f       flow(0.0f, 0.0f);
+  Analyzer::Layout layout   = Analyzer::LAYOUT_RASTER;
+  for (int a = 1; a < argc; ++a) {
+    if (strcmp(argv[a], "--morton") == 0) {
+      layout = Analyzer::LAYOUT_MORTON;
+    } else if (strcmp(argv[a], "--mip") == 0 && a + 1 < argc) {
+      mipfile = argv[++a];
+    } else if (strcmp(argv[a], "--coords") == 0 && a + 1 < argc) {
+      coordfile = argv[++a];
+    } else if (strcmp(argv[a], "--budget") == 0 && a + 1 < argc) {
+      budget = atof(argv[++a]);
+    } else if (strcmp(argv[a], "--bench-layout") == 0 && a + 1 < argc) {
+      bench = atoi(argv[++a]);
+    } else if (strcmp(argv[a], "--bench-kernel") == 0 && a + 1 < argc) {
+      benchKernel = atoi(argv[++a]);
+    } else if (strcmp(argv[a], "--frames") == 0 && a + 1 < argc) {
+      frames = atoi(argv[++a]);
+    } else if (strcmp(argv[a], "--flow") == 0 && a + 2 < argc) {
+      flow[0] = atof(argv[++a]);
+      flow[1] = atof(argv[++a]);
+    } else {
+      exemplar = argv[a];
+    }
+  }
+
   // load the exemplar
 
-  ImageBuf* ex = new ImageBuf("TestData/stone3_exemplar.png");
+  std::shared_ptr<const ImageBuf> ex(new ImageBuf(exemplar));
+  if (bench > 0) {
+    benchLayouts(ex, bench, 3);
+    return (0);
+  }
+  if (benchKernel > 0) {
+    benchKernels(ex, benchKernel, 3);
+    return (0);
+  }
   //ImageBuf* pcaBuf = DoPCA1(ex);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
   // init the analyzer
-  Analyzer    analyzer(ex, ex);
+  std::shared_ptr<const Analyzer> analyzer = Analyzer::create(ex, ex, layout);
   // init the synthesizer
   Synthesizer synthesizer(analyzer);
 
-  analyzer.run();
-
-  synthesizer.init( 512, 512, 25.0f, 0.2f , 2);
+  if (budget > 0.0) {
+    // fit the quality parameters to the time budget, measured on this machine
+    BudgetTuner tuner(analyzer);
+    tuner.calibrate(25.0f, 0.2f);
+    BudgetTuner::Config config = tuner.choose(512, 512, budget);
+    cout << "budget " << budget << " ms: " << config.str() << endl;
+    BudgetTuner::apply(synthesizer, config, 512, 512, 25.0f, 0.2f);
+    start = std::chrono::steady_clock::now();
+  } else {
+    synthesizer.init( 512, 512, 25.0f, 0.2f , 2);
+    // converge adaptively: stop once less than 1% of the pixels change, never more than 6 passes
+    synthesizer.setCorrectionPasses(0.01f, 1, 6);
+  }
+  // only the finest level is saved, coarser ones can be freed as we go,
+  // unless they make up the mip chain
+  synthesizer.setRetainedLevels(mipfile.empty() ? 1 : 0);
   //    // go down synthesis pyramid until finest level reached
   while (!synthesizer.done()) {
   // synthesize next level
     synthesizer.synthesizeNextLevel();
   }
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  cout << "analysis + synthesis: " << ms << " ms ("
+       << (analyzer->layout() == Analyzer::LAYOUT_MORTON ? "morton" : "raster") << " layout)" << endl;
 
   synthesizer.result()->save(std::string("testsynth.png"), std::string("png"));
   synthesizer.resultPatches()->save(std::string("testcoords.png"), std::string("png"));
 
+  if (!coordfile.empty()) {
+    // compact indirection map, colors are rebuilt from it and the exemplar
+    CoordinateMap map(synthesizer.resultCoords(), ex->spec().width, ex->spec().height);
+    if (!map.save(coordfile, 64)) {
+      cerr << "cannot write coordinate map to " << coordfile << endl;
+    }
+  }
+
+  if (!mipfile.empty()) {
+    std::vector<ImageBuf*> chain = synthesizer.resultMipChain();
+    if (!saveMipChain(chain, mipfile)) {
+      cerr << "cannot write mip chain to " << mipfile << endl;
+    }
+    for (size_t m = 0; m < chain.size(); ++m) {
+      delete chain[m];
+    }
+  }
+
+  for (size_t step = 0; step < synthesizer.passCounts().size(); ++step) {
+    cout << "step " << step << ": " << synthesizer.passCounts()[step] << " correction passes" << endl;
+  }
+
+  // animation: every frame starts from the previous one, advected by a uniform
+  // flow, and only corrects it at the finest level where the flow deformed it
+  if (frames > 1) {
+    const Synthesizer::SynthesisData& first = synthesizer.resultCoords();
+    Synthesizer::FlowField flowField(boost::extents[Synthesizer::rowsOf(first)][Synthesizer::columnsOf(first)]);
+    std::fill(flowField.data(), flowField.data() + flowField.num_elements(), flow);
+    std::unique_ptr<Synthesizer> previous;
+    for (int f = 1; f < frames; ++f) {
+      start = std::chrono::steady_clock::now();
+      std::unique_ptr<Synthesizer> frame(new Synthesizer(analyzer));
+      frame->initFromPrevious(previous ? previous->resultCoords() : first, 0, &flowField, 0.0f, 0.2f, 2, f + 1);
+      frame->setCorrectionPasses(0.01f, 1, 4);
+      frame->setRetainedLevels(1);
+      while (!frame->done()) {
+        frame->synthesizeNextLevel();
+      }
+      ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      cout << "frame " << f << ": " << ms << " ms" << endl;
+      char name[64];
+      snprintf(name, sizeof(name), "testsynth_%03d.png", f);
+      ImageBuf* img = frame->result();
+      img->save(std::string(name), std::string("png"));
+      delete img;
+      previous.swap(frame);
+    }
+  }
+
   return (0);
 }
 
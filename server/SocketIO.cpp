@@ -0,0 +1,32 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "SocketIO.h"
+
+// --------------------------------------------------------------
+
+bool writeAll(int fd, const void* data, size_t size)
+{
+  const char* ptr = (const char*)data;
+  while (size > 0) {
+    ssize_t n = send(fd, ptr, size, MSG_NOSIGNAL);
+    if (n <= 0) return false;
+    ptr  += n;
+    size -= n;
+  }
+  return true;
+}
+
+// --------------------------------------------------------------
+
+bool readAll(int fd, void* data, size_t size)
+{
+  char* ptr = (char*)data;
+  while (size > 0) {
+    ssize_t n = recv(fd, ptr, size, 0);
+    if (n <= 0) return false;
+    ptr  += n;
+    size -= n;
+  }
+  return true;
+}
@@ -0,0 +1,17 @@
+#ifndef _SOCKETIO_H__
+#define _SOCKETIO_H__
+
+#include <stddef.h>
+
+/**
+Blocking I/O helpers for stream sockets, shared by the synthesis daemon and
+the distributed synthesis workers. Writes never raise SIGPIPE.
+*/
+
+//! writes the whole buffer, returns false if the peer went away
+bool writeAll(int fd, const void* data, size_t size);
+
+//! reads exactly size bytes, returns false on end of stream
+bool readAll(int fd, void* data, size_t size);
+
+#endif // _SOCKETIO_H__
@@ -0,0 +1,412 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sstream>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+
+#include "SynthesisServer.h"
+#include "SocketIO.h"
+
+using namespace std;
+
+// --------------------------------------------------------------
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsedMs(const Clock::time_point& from, const Clock::time_point& to)
+{
+  return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+//! largest synthesis domain served, in pixels
+static const long long MaxPixels = 16384LL * 16384LL;
+
+//! largest exemplar side accepted, in pixels
+static const int MaxExemplarSide = 32768;
+
+//! returns why an exemplar cannot be analyzed, empty if it can
+static std::string invalidExemplar(const ImageSpec& spec)
+{
+  if (spec.width < 2 || spec.height < 2) return "exemplar must be at least 2x2 pixels";
+  if (spec.width > MaxExemplarSide || spec.height > MaxExemplarSide) return "exemplar too large";
+  // see the Analyzer constructor
+  bool pow2 = (spec.width & (spec.width - 1)) == 0;
+  if (!pow2 && spec.width != spec.height) return "exemplar must be square or a power of two wide";
+  return "";
+}
+
+//! returns why a SYNTH request cannot be served, empty if it can
+static std::string invalidRequest(const SynthesisServer::Request& r)
+{
+  if (r.width <= 0 || r.height <= 0) return "empty synthesis domain";
+  if ((long long)r.width * r.height > MaxPixels) return "synthesis domain too large";
+  if (!(r.kappa > 0.0f)) return "kappa must be positive";
+  if (!std::isfinite(r.jitter)) return "jitter must be finite";
+  if (r.subpass < 1) return "subpass must be at least 1";
+  if (r.x < 0 || r.y < 0 || r.w <= 0 || r.h <= 0
+      || (long long)r.x + r.w > r.width || (long long)r.y + r.h > r.height) {
+    return "window outside of synthesized domain";
+  }
+  return "";
+}
+
+static bool writeLine(int fd, const std::string& line)
+{
+  return writeAll(fd, line.c_str(), line.size());
+}
+
+//! reads one '\n' terminated line, returns false on end of stream
+static bool readLine(int fd, std::string& line)
+{
+  line.clear();
+  char c;
+  while (recv(fd, &c, 1, 0) == 1) {
+    if (c == '\n') return true;
+    if (c != '\r') line += c;
+    if (line.size() > 4096) return false;
+  }
+  return false;
+}
+
+// --------------------------------------------------------------
+
+SynthesisServer::SynthesisServer(const std::string& address, size_t cacheSize, int maxRunning, int maxQueued)
+  : m_Address(address), m_Socket(-1), m_CacheSize(cacheSize),
+    m_MaxRunning(maxRunning), m_MaxQueued(maxQueued), m_Running(0), m_Queued(0),
+    m_Served(0), m_Rejected(0), m_Failed(0), m_CacheHits(0)
+{
+  assert(cacheSize > 0 && maxRunning > 0 && maxQueued >= 0);
+  memset(&m_Sum, 0, sizeof(Metrics));
+  memset(&m_Max, 0, sizeof(Metrics));
+}
+
+// --------------------------------------------------------------
+
+SynthesisServer::~SynthesisServer()
+{
+  if (m_Socket >= 0) {
+    close(m_Socket);
+  }
+}
+
+// --------------------------------------------------------------
+
+bool SynthesisServer::run()
+{
+  // A purely numeric address is a loopback TCP port, anything else a UNIX socket path
+  bool tcp = !m_Address.empty() && m_Address.find_first_not_of("0123456789") == std::string::npos;
+  if (tcp) {
+    m_Socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (m_Socket < 0) return false;
+    int on = 1;
+    setsockopt(m_Socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(atoi(m_Address.c_str()));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(m_Socket, (sockaddr*)&addr, sizeof(addr)) < 0) return false;
+  } else {
+    m_Socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_Socket < 0) return false;
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (m_Address.size() >= sizeof(addr.sun_path)) return false;
+    strcpy(addr.sun_path, m_Address.c_str());
+    unlink(m_Address.c_str());
+    if (bind(m_Socket, (sockaddr*)&addr, sizeof(addr)) < 0) return false;
+  }
+  if (listen(m_Socket, 64) < 0) return false;
+  fprintf(stderr, "texsyn: serving on %s\n", m_Address.c_str());
+
+  while (true) {
+    int fd = accept(m_Socket, NULL, NULL);
+    if (fd < 0) continue;
+    std::thread(&SynthesisServer::serveConnection, this, fd).detach();
+  }
+  return true;
+}
+
+// --------------------------------------------------------------
+
+void SynthesisServer::serveConnection(int fd)
+{
+  std::string line;
+  while (readLine(fd, line)) {
+    std::istringstream in(line);
+    std::string cmd;
+    in >> cmd;
+    if (cmd == "SYNTH") {
+      Request r;
+      std::string format;
+      in >> r.exemplar >> r.seed >> r.width >> r.height >> r.x >> r.y >> r.w >> r.h
+         >> r.jitter >> r.kappa >> r.subpass >> format;
+      if (in.fail() || (format != "color" && format != "coords")) {
+        writeLine(fd, "ERR malformed SYNTH request\n");
+        continue;
+      }
+      r.coords = (format == "coords");
+      serveSynthesis(fd, r);
+    } else if (cmd == "STATS") {
+      serveStats(fd);
+    } else {
+      writeLine(fd, "ERR unknown command\n");
+    }
+  }
+  close(fd);
+}
+
+// --------------------------------------------------------------
+
+SynthesisServer::AnalyzerPtr SynthesisServer::analyzer(const std::string& exemplar, bool& hit, std::string& error)
+{
+  std::promise<AnalyzerPtr>    loaded;
+  std::shared_future<AnalyzerPtr> entry;
+  {
+    std::lock_guard<std::mutex> lock(m_CacheLock);
+    std::map<std::string, LRUList::iterator>::iterator it = m_CacheIndex.find(exemplar);
+    if (it != m_CacheIndex.end()) {
+      // hit - move to front; the analyzer may still be loading for another request
+      m_Cache.splice(m_Cache.begin(), m_Cache, it->second);
+      hit = true;
+      entry = it->second->second;
+    } else {
+      hit = false;
+      entry = loaded.get_future().share();
+      m_Cache.push_front(std::make_pair(exemplar, entry));
+      m_CacheIndex[exemplar] = m_Cache.begin();
+      // evicted analyzers stay alive until their in-flight requests complete
+      while (m_Cache.size() > m_CacheSize) {
+        m_CacheIndex.erase(m_Cache.back().first);
+        m_Cache.pop_back();
+      }
+    }
+  }
+  if (hit) {
+    // rethrows if loading failed for the other request
+    AnalyzerPtr a = entry.get();
+    if (!a) {
+      error = "cannot load exemplar " + exemplar;
+    }
+    return a;
+  }
+
+  // miss - load and analyze outside of the lock; on failure, requests waiting
+  // on the entry are answered too, and the entry is dropped so that a later
+  // request retries
+  auto forget = [&]() {
+    std::lock_guard<std::mutex> lock(m_CacheLock);
+    std::map<std::string, LRUList::iterator>::iterator it = m_CacheIndex.find(exemplar);
+    if (it != m_CacheIndex.end()) {
+      m_Cache.erase(it->second);
+      m_CacheIndex.erase(it);
+    }
+  };
+  try {
+    std::shared_ptr<ImageBuf> ex(new ImageBuf(exemplar));
+    if (!ex->read(0, 0, true, TypeDesc::FLOAT)) {
+      error = "cannot load exemplar " + exemplar;
+    } else {
+      error = invalidExemplar(ex->spec());
+    }
+    if (!error.empty()) {
+      loaded.set_value(AnalyzerPtr());
+      forget();
+      return AnalyzerPtr();
+    }
+    AnalyzerPtr a = Analyzer::create(ex, ex);
+    loaded.set_value(a);
+    return a;
+  } catch (...) {
+    loaded.set_exception(std::current_exception());
+    forget();
+    throw;
+  }
+}
+
+// --------------------------------------------------------------
+
+bool SynthesisServer::admit()
+{
+  std::unique_lock<std::mutex> lock(m_AdmissionLock);
+  if (m_Running >= m_MaxRunning && m_Queued >= m_MaxQueued) {
+    return false;
+  }
+  m_Queued ++;
+  m_AdmissionCond.wait(lock, [&]() { return m_Running < m_MaxRunning; });
+  m_Queued --;
+  m_Running ++;
+  return true;
+}
+
+// --------------------------------------------------------------
+
+void SynthesisServer::release()
+{
+  std::lock_guard<std::mutex> lock(m_AdmissionLock);
+  m_Running --;
+  m_AdmissionCond.notify_one();
+}
+
+// --------------------------------------------------------------
+
+void SynthesisServer::serveSynthesis(int fd, const Request& r)
+{
+  Metrics m;
+  Clock::time_point t0 = Clock::now();
+  // parameters the synthesizer cannot run with are refused before taking a slot
+  std::string invalid = invalidRequest(r);
+  if (!invalid.empty()) {
+    {
+      std::lock_guard<std::mutex> lock(m_StatsLock);
+      m_Failed ++;
+    }
+    writeLine(fd, "ERR " + invalid + "\n");
+    return;
+  }
+  if (!admit()) {
+    {
+      std::lock_guard<std::mutex> lock(m_StatsLock);
+      m_Rejected ++;
+    }
+    writeLine(fd, "BUSY\n");
+    return;
+  }
+  Clock::time_point t1 = Clock::now();
+
+  // this runs on a detached thread: an exception escaping it would terminate the server
+  AnalyzerPtr a;
+  std::string error;
+  Clock::time_point t2;
+  std::unique_ptr<Synthesizer> synthesizer;
+  try {
+    a  = analyzer(r.exemplar, m.cacheHit, error);
+    t2 = Clock::now();
+    if (!a) {
+      release();
+      std::lock_guard<std::mutex> lock(m_StatsLock);
+      m_Failed ++;
+      writeLine(fd, "ERR " + error + "\n");
+      return;
+    }
+    synthesizer.reset(new Synthesizer(a));
+    synthesizer->setRetainedLevels(1);
+    synthesizer->init(r.width, r.height, r.jitter, r.kappa, r.subpass, r.seed);
+    while (!synthesizer->done()) {
+      synthesizer->synthesizeNextLevel();
+    }
+  } catch (...) {
+    synthesizer.reset();
+    release();
+    std::lock_guard<std::mutex> lock(m_StatsLock);
+    m_Failed ++;
+    writeLine(fd, "ERR synthesis failed\n");
+    return;
+  }
+  Clock::time_point t3 = Clock::now();
+
+  // the result covers at least W x H, unless the exemplar is not a power of two
+  const Synthesizer::SynthesisData& coords = synthesizer->resultCoords();
+  int row    = Synthesizer::rowsOf(coords);
+  int column = Synthesizer::columnsOf(coords);
+  if (r.x + r.w > column || r.y + r.h > row) {
+    release();
+    std::lock_guard<std::mutex> lock(m_StatsLock);
+    m_Failed ++;
+    writeLine(fd, "ERR window outside of synthesized domain\n");
+    return;
+  }
+
+  // extract the window while still holding the slot; only the window is
+  // colorized, the domain may be far larger
+  const ImageBuf* ex = a->ex();
+  int width  = ex->spec().width;
+  int height = ex->spec().height;
+  int nc = r.coords ? 2 : 3;
+  std::vector<char> payload((size_t)r.w * r.h * nc * (r.coords ? sizeof(short) : sizeof(float)));
+  short* coord_out = (short*)&payload[0];
+  float* color_out = (float*)&payload[0];
+  for (int j = 0; j < r.h; ++j) {
+    for (int i = 0; i < r.w; ++i) {
+      Imath::V2s xy = coords[r.y + j][r.x + i];
+      int x = ImageStack::wrapAccess(xy[0], width);
+      int y = ImageStack::wrapAccess(xy[1], height);
+      if (r.coords) {
+        *coord_out++ = x;
+        *coord_out++ = y;
+      } else {
+        ex->getpixel(x, y, color_out);
+        color_out += nc;
+      }
+    }
+  }
+  release();
+
+  Clock::time_point t4 = Clock::now();
+  m.queue     = elapsedMs(t0, t1);
+  m.analysis  = elapsedMs(t1, t2);
+  m.synthesis = elapsedMs(t2, t3);
+  m.total     = elapsedMs(t0, t4);
+  record(m);
+
+  char header[256];
+  snprintf(header, sizeof(header), "OK %d %d %d %s %lu %.3f\n", r.w, r.h, nc,
+           r.coords ? "int16" : "float32", (unsigned long)payload.size(), m.total);
+  if (writeLine(fd, header)) {
+    writeAll(fd, &payload[0], payload.size());
+  }
+  fprintf(stderr, "texsyn: %s seed=%u %dx%d window=%d,%d,%dx%d %s queue=%.1fms analysis=%.1fms%s synthesis=%.1fms total=%.1fms\n",
+          r.exemplar.c_str(), r.seed, r.width, r.height, r.x, r.y, r.w, r.h, r.coords ? "coords" : "color",
+          m.queue, m.analysis, m.cacheHit ? "(hit)" : "(miss)", m.synthesis, m.total);
+}
+
+// --------------------------------------------------------------
+
+void SynthesisServer::record(const Metrics& m)
+{
+  std::lock_guard<std::mutex> lock(m_StatsLock);
+  m_Served ++;
+  if (m.cacheHit) m_CacheHits ++;
+  m_Sum.queue     += m.queue;
+  m_Sum.analysis  += m.analysis;
+  m_Sum.synthesis += m.synthesis;
+  m_Sum.total     += m.total;
+  m_Max.queue     = std::max(m_Max.queue,     m.queue);
+  m_Max.analysis  = std::max(m_Max.analysis,  m.analysis);
+  m_Max.synthesis = std::max(m_Max.synthesis, m.synthesis);
+  m_Max.total     = std::max(m_Max.total,     m.total);
+}
+
+// --------------------------------------------------------------
+
+void SynthesisServer::serveStats(int fd)
+{
+  int running, queued;
+  {
+    std::lock_guard<std::mutex> lock(m_AdmissionLock);
+    running = m_Running;
+    queued  = m_Queued;
+  }
+  char line[1024];
+  {
+    std::lock_guard<std::mutex> lock(m_StatsLock);
+    double n = std::max(m_Served, 1L);
+    snprintf(line, sizeof(line),
+             "OK served=%ld rejected=%ld failed=%ld cache_hits=%ld running=%d queued=%d"
+             " mean_queue_ms=%.3f mean_analysis_ms=%.3f mean_synthesis_ms=%.3f mean_total_ms=%.3f"
+             " max_queue_ms=%.3f max_analysis_ms=%.3f max_synthesis_ms=%.3f max_total_ms=%.3f\n",
+             m_Served, m_Rejected, m_Failed, m_CacheHits, running, queued,
+             m_Sum.queue / n, m_Sum.analysis / n, m_Sum.synthesis / n, m_Sum.total / n,
+             m_Max.queue, m_Max.analysis, m_Max.synthesis, m_Max.total);
+  }
+  writeLine(fd, line);
+}
@@ -0,0 +1,120 @@
+#ifndef _SYNTHESISSERVER_H__
+#define _SYNTHESISSERVER_H__
+
+#include <string>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <condition_variable>
+
+#include "../synthesizer/Synthesizer.h"
+
+/**
+Long-running synthesis daemon.
+
+Analyzers are kept warm in an LRU cache keyed by exemplar path, so that image
+loading, stack construction and kNN analysis are paid once per exemplar rather
+than once per request. Requests are read from a local UNIX socket, or from a
+loopback TCP port when the address is a number.
+
+Protocol - one request per line, any number of requests per connection:
+
+  SYNTH <exemplar> <seed> <W> <H> <x> <y> <w> <h> <jitter> <kappa> <subpass> <color|coords>
+    synthesizes a W x H texture and returns the window [x,x+w) x [y,y+h) of it.
+    W x H is limited to 16384 x 16384 pixels, kappa must be positive and
+    subpass at least 1; other requests are refused before being queued.
+    The exemplar must be 2 to 32768 pixels on each side, and square or a
+    power of two wide.
+    Answer: "OK <w> <h> <channels> <float32|int16> <bytes> <ms>\n" followed by
+    <bytes> bytes of row-major pixels, either RGB colors or exemplar coordinates.
+  STATS
+    Answer: "OK <key>=<value> ...\n" with request counts and latencies.
+
+Errors are answered with "ERR <message>\n"; requests refused by admission
+control with "BUSY\n".
+*/
+class SynthesisServer
+{
+public:
+  //! request parameters, as parsed from a SYNTH line
+  struct Request
+  {
+    std::string  exemplar;
+    unsigned int seed;
+    int          width, height;     // synthesis domain
+    int          x, y, w, h;        // returned window
+    float        jitter;
+    float        kappa;
+    int          subpass;
+    bool         coords;            // return coordinates instead of colors
+  };
+
+  //! per-request latency breakdown, in milliseconds
+  struct Metrics
+  {
+    double queue;                   // waiting for admission
+    double analysis;                // fetching (and possibly computing) the analyzer
+    double synthesis;               // init + all synthesis steps
+    double total;
+    bool   cacheHit;
+  };
+
+private:
+  typedef std::shared_ptr<const Analyzer>                  AnalyzerPtr;
+  typedef std::list<std::pair<std::string, std::shared_future<AnalyzerPtr> > > LRUList;
+
+  std::string                             m_Address;       // socket path or TCP port
+  int                                     m_Socket;        // listening socket
+
+  LRUList                                 m_Cache;         // most recently used first
+  std::map<std::string, LRUList::iterator> m_CacheIndex;
+  size_t                                  m_CacheSize;     // max number of warm analyzers
+  std::mutex                              m_CacheLock;
+
+  int                                     m_MaxRunning;    // max concurrent syntheses
+  int                                     m_MaxQueued;     // max requests waiting for a slot
+  int                                     m_Running;
+  int                                     m_Queued;
+  std::mutex                              m_AdmissionLock;
+  std::condition_variable                 m_AdmissionCond;
+
+  // aggregated metrics, protected by m_StatsLock
+  long                                    m_Served;
+  long                                    m_Rejected;
+  long                                    m_Failed;
+  long                                    m_CacheHits;
+  Metrics                                 m_Sum;
+  Metrics                                 m_Max;
+  std::mutex                              m_StatsLock;
+
+  //! returns the analyzer of an exemplar, loading and analyzing it on a cache miss;
+  //! NULL with the reason in error if the exemplar cannot be loaded or analyzed
+  AnalyzerPtr  analyzer(const std::string& exemplar, bool& hit, std::string& error);
+  //! blocks until a synthesis slot is free; false if the request must be refused
+  bool         admit();
+  void         release();
+  void         record(const Metrics& m);
+
+  //! serves all requests of one connection, then closes it
+  void         serveConnection(int fd);
+  //! runs one SYNTH request, writing the answer to fd
+  void         serveSynthesis(int fd, const Request& r);
+  void         serveStats(int fd);
+
+public:
+  /**
+  Constructor - address is either a UNIX socket path or a loopback TCP port
+  */
+  SynthesisServer(const std::string& address, size_t cacheSize = 4, int maxRunning = 2, int maxQueued = 16);
+  ~SynthesisServer();
+
+  /**
+  Accepts and serves connections until the process is terminated.
+  Returns false if the socket could not be set up.
+  */
+  bool         run();
+};
+
+#endif // _SYNTHESISSERVER_H__
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <math.h>
+#include <chrono>
+#include <algorithm>
+
+#include "BudgetTuner.h"
+
+using namespace std;
+
+// --------------------------------------------------------------
+
+std::string BudgetTuner::Config::str() const
+{
+  char buf[256];
+  snprintf(buf, sizeof(buf), "subpass level %d, %d correction passes, %d candidates (predicted %.1f ms)",
+           subpassLevel, passes, candidates, predicted);
+  return buf;
+}
+
+// --------------------------------------------------------------
+
+BudgetTuner::BudgetTuner(std::shared_ptr<const Analyzer> a)
+  : m_Analyzer(a), m_Upsample(0.0), m_Visit(0.0), m_Candidate(0.0), m_Jitter(0.0f), m_Kappa(1.0f), m_Calibrated(false)
+{
+
+}
+
+// --------------------------------------------------------------
+
+void BudgetTuner::apply(Synthesizer& s, const Config& c, unsigned int w, unsigned int h,
+                        float jitterStrength, float kappa, unsigned int seed)
+{
+  s.init(w, h, jitterStrength, kappa, c.subpassLevel, seed);
+  s.setCorrectionPasses(0.0f, c.passes, c.passes);
+  s.setCandidates(c.candidates);
+}
+
+// --------------------------------------------------------------
+
+double BudgetTuner::measure(unsigned int w, unsigned int h, const Config& c)
+{
+  Synthesizer s(m_Analyzer);
+  apply(s, c, w, h, m_Jitter, m_Kappa);
+  s.setRetainedLevels(1);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  while (!s.done()) {
+    s.synthesizeNextLevel();
+  }
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// --------------------------------------------------------------
+
+double BudgetTuner::pixelCount(unsigned int w, unsigned int h) const
+{
+  // mirrors Synthesizer::init - the coarsest level has one pixel per exemplar
+  // tile and every step doubles the resolution; the first level is not corrected
+  int ex_w  = m_Analyzer->ex()->spec().width;
+  int ex_h  = m_Analyzer->ex()->spec().height;
+  double nx = ceil(w / double(ex_w));
+  double ny = ceil(h / double(ex_h));
+  int steps = m_Analyzer->stack()->numLevels() - 1;
+  double count = 0.0;
+  for (int s = 1; s <= steps; ++s) {
+    count += nx * ny * double(1 << (2*s));
+  }
+  return count;
+}
+
+// --------------------------------------------------------------
+
+void BudgetTuner::calibrate(float jitterStrength, float kappa)
+{
+  // without jitter, nearly every pixel lies in a coherent patch and is skipped
+  // by correction: the runs must see the same fraction of corrected pixels as
+  // the budgeted synthesis
+  m_Jitter = jitterStrength;
+  m_Kappa  = kappa;
+  // smallest possible domain: a single exemplar tile
+  unsigned int w = m_Analyzer->ex()->spec().width;
+  unsigned int h = m_Analyzer->ex()->spec().height;
+  double P = pixelCount(w, h);
+
+  Config base = { 1, 1, 1, 0.0 };
+  Config cand = { 1, 1, K, 0.0 };
+  Config visit = { 4, 1, 1, 0.0 };
+
+  // warm-up, this also analyzes every level the synthesizer needs
+  measure(w, h, base);
+
+  double t_base  = measure(w, h, base);
+  double t_cand  = measure(w, h, cand);
+  double t_visit = measure(w, h, visit);
+
+  m_Candidate = std::max(0.0, (t_cand  - t_base) / (P * 9 * (K - 1)));
+  m_Visit     = std::max(0.0, (t_visit - t_base) / (P * (16 - 1)));
+  m_Upsample  = std::max(0.0, t_base / P - m_Visit - m_Candidate * 10);
+  m_Calibrated = true;
+}
+
+// --------------------------------------------------------------
+
+double BudgetTuner::predict(unsigned int w, unsigned int h, const Config& c) const
+{
+  assert(m_Calibrated);
+  double per_pass = c.subpassLevel * c.subpassLevel * m_Visit + (9 * c.candidates + 1) * m_Candidate;
+  return pixelCount(w, h) * (m_Upsample + c.passes * per_pass);
+}
+
+// --------------------------------------------------------------
+
+BudgetTuner::Config BudgetTuner::choose(unsigned int w, unsigned int h, double budget) const
+{
+  // Quality ranking is a heuristic: correction passes matter most, then the
+  // number of candidates, then sub-passes (1 disables the sub-pass ordering).
+  static const int subpasses[]  = { 1, 2, 3 };
+  static const int passes[]     = { 1, 2, 3, 4 };
+  static const int candidates[] = { 1, 2, 4, K };
+  Config best     = { 0, 0, 0, 0.0 };
+  Config cheapest = { 0, 0, 0, 0.0 };
+  float  best_q   = -1.0f;
+  for (int s = 0; s < 3; ++s) {
+    for (int p = 0; p < 4; ++p) {
+      for (int c = 0; c < 4; ++c) {
+        Config cfg = { subpasses[s], passes[p], std::min(candidates[c], K), 0.0 };
+        cfg.predicted = predict(w, h, cfg);
+        float q = 4.0f * cfg.passes + 2.0f * log2(float(cfg.candidates)) + (cfg.subpassLevel > 1 ? 3.0f : 0.0f) + 0.5f * cfg.subpassLevel;
+        if (cheapest.passes == 0 || cfg.predicted < cheapest.predicted) {
+          cheapest = cfg;
+        }
+        if (cfg.predicted <= budget && (q > best_q || (q == best_q && cfg.predicted < best.predicted))) {
+          best   = cfg;
+          best_q = q;
+        }
+      }
+    }
+  }
+  return (best_q < 0.0f) ? cheapest : best;
+}
@@ -0,0 +1,70 @@
+#ifndef _BUDGETTUNER_H__
+#define _BUDGETTUNER_H__
+
+#include <string>
+#include "Synthesizer.h"
+
+/**
+Picks synthesis quality parameters that fit a wall-clock budget.
+
+The cost of a run is modeled as, summed over all synthesized pixels P:
+
+  P * (upsample + passes * (subpass^2 * visit + (9*candidates+1) * candidate))
+
+where the three per-pixel costs are measured on the current machine by
+calibrate(). Correction skips pixels inside coherent patches, so these
+costs depend on the jitter and kappa of the run; calibrate() must be given
+the ones later passed to apply(). The budget covers synthesis only; the
+analyzer is warmed up during calibration.
+*/
+class BudgetTuner
+{
+public:
+  //! a quality configuration and its predicted cost
+  struct Config
+  {
+    int    subpassLevel;
+    int    passes;
+    int    candidates;
+    double predicted;   // milliseconds
+    std::string str() const;
+  };
+
+private:
+  std::shared_ptr<const Analyzer> m_Analyzer;
+  double     m_Upsample;    // ms per pixel, upsampling + jitter
+  double     m_Visit;       // ms per pixel and sub-pass, sub-pass scheduling overhead
+  double     m_Candidate;   // ms per pixel and candidate, distance evaluation
+  float      m_Jitter;      // jitter and kappa of the calibration runs
+  float      m_Kappa;
+  bool       m_Calibrated;
+
+  //! runs a full synthesis with the given configuration, returns the wall time in ms
+  double     measure(unsigned int w, unsigned int h, const Config& c);
+  //! total number of pixels corrected by a run of size w x h
+  double     pixelCount(unsigned int w, unsigned int h) const;
+
+public:
+  BudgetTuner(std::shared_ptr<const Analyzer> a);
+
+  /**
+  Measures the cost model coefficients with a few single-tile runs, using
+  the jitter strength and kappa of the synthesis to be budgeted.
+  */
+  void       calibrate(float jitterStrength, float kappa);
+
+  /**
+  Returns the highest quality configuration predicted to synthesize w x h
+  within budget milliseconds, or the cheapest one if none fits.
+  */
+  Config     choose(unsigned int w, unsigned int h, double budget) const;
+
+  //! predicted cost of a configuration, in ms
+  double     predict(unsigned int w, unsigned int h, const Config& c) const;
+
+  //! applies a configuration to a synthesizer and initializes it
+  static void apply(Synthesizer& s, const Config& c, unsigned int w, unsigned int h,
+                    float jitterStrength, float kappa, unsigned int seed = 1);
+};
+
+#endif // _BUDGETTUNER_H__
@@ -0,0 +1,148 @@
+#include <math.h>
+#include <algorithm>
+#include <tbb/tbb.h>
+#include <OpenImageIO/imageio.h>
+
+#include "CoordinateMap.h"
+
+using namespace std;
+using namespace tbb;
+
+// --------------------------------------------------------------
+
+CoordinateMap::CoordinateMap()
+  : m_Width(0), m_Height(0), m_ExemplarWidth(0), m_ExemplarHeight(0)
+{
+
+}
+
+// --------------------------------------------------------------
+
+CoordinateMap::CoordinateMap(const Synthesizer::SynthesisData& synthesis, int exemplarWidth, int exemplarHeight)
+  : m_Width(Synthesizer::columnsOf(synthesis)), m_Height(Synthesizer::rowsOf(synthesis)),
+    m_ExemplarWidth(exemplarWidth), m_ExemplarHeight(exemplarHeight)
+{
+  assert(exemplarWidth <= 32768 && exemplarHeight <= 32768);
+  // indices are size_t: maps of 32768 x 32768 and more are the point of the format
+  m_Coords.resize(size_t(m_Width) * m_Height * 2);
+  for (int j = 0; j < m_Height; ++j) {
+    for (int i = 0; i < m_Width; ++i) {
+      Imath::V2s xy = synthesis[j][i];
+      size_t c = (i + size_t(j) * m_Width) * 2;
+      m_Coords[c    ] = ImageStack::wrapAccess(xy[0], exemplarWidth);
+      m_Coords[c + 1] = ImageStack::wrapAccess(xy[1], exemplarHeight);
+    }
+  }
+}
+
+// --------------------------------------------------------------
+
+bool CoordinateMap::save(const std::string& filename, int tileSize) const
+{
+  ImageOutput* out = ImageOutput::create(filename);
+  if (!out) {
+    return false;
+  }
+  ImageSpec spec(m_Width, m_Height, 2, TypeDesc::UINT16);
+  if (tileSize > 0 && out->supports("tiles")) {
+    spec.tile_width  = tileSize;
+    spec.tile_height = tileSize;
+    spec.tile_depth  = 1;
+  }
+  spec.attribute("texsyn:exemplar_width",  m_ExemplarWidth);
+  spec.attribute("texsyn:exemplar_height", m_ExemplarHeight);
+  // a format without uint16 would silently convert the coordinates
+  bool ok = out->open(filename, spec) && out->spec().format == TypeDesc::UINT16
+            && out->write_image(TypeDesc::UINT16, &m_Coords[0]);
+  out->close();
+  delete out;
+  return ok;
+}
+
+// --------------------------------------------------------------
+
+bool CoordinateMap::load(const std::string& filename)
+{
+  ImageInput* in = ImageInput::open(filename);
+  if (!in) {
+    return false;
+  }
+  const ImageSpec& spec = in->spec();
+  bool ok = (spec.nchannels == 2);
+  if (ok) {
+    m_Width          = spec.width;
+    m_Height         = spec.height;
+    m_ExemplarWidth  = spec.get_int_attribute("texsyn:exemplar_width",  0);
+    m_ExemplarHeight = spec.get_int_attribute("texsyn:exemplar_height", 0);
+    ok = (m_Width > 0 && m_Height > 0
+          && m_ExemplarWidth > 0 && m_ExemplarHeight > 0 && m_ExemplarWidth <= 32768 && m_ExemplarHeight <= 32768);
+  }
+  if (ok) {
+    m_Coords.resize(size_t(m_Width) * m_Height * 2);
+    ok = in->read_image(TypeDesc::UINT16, &m_Coords[0]);
+  }
+  // colorize indexes the exemplar with the coordinates, a mismatched or corrupt file must not get there
+  for (size_t c = 0; ok && c < m_Coords.size(); c += 2) {
+    ok = (m_Coords[c] < m_ExemplarWidth && m_Coords[c + 1] < m_ExemplarHeight);
+  }
+  in->close();
+  delete in;
+  if (!ok) {
+    *this = CoordinateMap();
+  }
+  return ok;
+}
+
+// --------------------------------------------------------------
+
+ImageBuf* CoordinateMap::colorize(const ImageBuf* exemplar, int mip) const
+{
+  assert(exemplar->spec().width == m_ExemplarWidth && exemplar->spec().height == m_ExemplarHeight);
+  if (mip == 0) {
+    ImageSpec specOutput(m_Width, m_Height, 3, TypeDesc::FLOAT);
+    ImageBuf* img = new ImageBuf(specOutput);
+    for (int j = 0; j < m_Height; ++j) {
+      for (int i = 0; i < m_Width; ++i) {
+        Imath::V2s xy = coord(i, j);
+        float clr[3];
+        exemplar->getpixel(xy[0], xy[1], clr, 3);
+        img->setpixel(i, j, clr);
+      }
+    }
+    return img;
+  }
+  ImageStack stack(exemplar, mip + 1);
+  return colorize(&stack, mip);
+}
+
+// --------------------------------------------------------------
+
+ImageBuf* CoordinateMap::colorize(const ImageStack* stack, int mip) const
+{
+  assert(mip >= 0 && mip < int(stack->numLevels()));
+  assert(stack->level(mip)->spec().width == m_ExemplarWidth);
+  int width  = std::max(1, m_Width  >> mip);
+  int height = std::max(1, m_Height >> mip);
+  const float* src = stack->pixels(mip);
+  // lookups run in parallel, the ImageBuf is filled afterwards
+  std::vector<float> colors(size_t(width) * height * 3);
+  parallel_for( blocked_range<int>(0, height),
+    [&](const blocked_range<int>& r) {
+      for (int j = r.begin(); j != r.end(); ++j) {
+        for (int i = 0; i < width; ++i) {
+          Imath::V2s xy = coord(std::min(i << mip, m_Width - 1), std::min(j << mip, m_Height - 1));
+          const float* texel = src + (xy[0] + size_t(xy[1]) * m_ExemplarWidth) * 3;
+          std::copy(texel, texel + 3, &colors[(i + size_t(j) * width) * 3]);
+        }
+      }
+    }
+  );
+  ImageSpec specOutput(width, height, 3, TypeDesc::FLOAT);
+  ImageBuf* img = new ImageBuf(specOutput);
+  for (int j = 0; j < height; ++j) {
+    for (int i = 0; i < width; ++i) {
+      img->setpixel(i, j, &colors[(i + size_t(j) * width) * 3]);
+    }
+  }
+  return img;
+}
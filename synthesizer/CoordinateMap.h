@@ -0,0 +1,56 @@
+#ifndef _COORDINATEMAP_H__
+#define _COORDINATEMAP_H__
+
+#include <string>
+#include <vector>
+#include "Synthesizer.h"
+
+/**
+Compact form of a synthesis result: the exemplar coordinate of every pixel,
+16 bits per axis, saved as a two channel uint16 image (optionally tiled).
+Together with the exemplar it reconstructs the colors, and any mip level, of
+the result without re-running synthesis.
+*/
+class CoordinateMap
+{
+private:
+  int                         m_Width;          // Map resolution
+  int                         m_Height;
+  int                         m_ExemplarWidth;  // Resolution of the exemplar the coordinates refer to
+  int                         m_ExemplarHeight;
+  std::vector<unsigned short> m_Coords;         // x,y per pixel, row-major
+
+public:
+  CoordinateMap();
+
+  /**
+  Builds the map of a synthesis result (see Synthesizer::resultCoords).
+  Coordinates are 16-bit signed during synthesis: the exemplar is at most 32768 pixels wide.
+  */
+  CoordinateMap(const Synthesizer::SynthesisData& synthesis, int exemplarWidth, int exemplarHeight);
+
+  //! writes the map; tileSize 0 writes scanlines. The format must store uint16
+  //! exactly (TIFF); formats that would convert it, such as EXR (half), are refused
+  bool save(const std::string& filename, int tileSize = 0) const;
+  //! reads a map written by save; maps with coordinates outside of the exemplar are refused
+  bool load(const std::string& filename);
+
+  /**
+  Reconstructs the colors of mip level 'mip' from the exemplar. Level 0 is a
+  plain lookup; level m looks up the exemplar Gaussian stack level m at the
+  coordinate of the first pixel of every 2^m x 2^m block, as synthesis does.
+  The stack variant avoids rebuilding the stack for every level.
+  */
+  ImageBuf* colorize(const ImageBuf* exemplar, int mip = 0) const;
+  ImageBuf* colorize(const ImageStack* stack, int mip) const;
+
+  int width () const { return m_Width;  }
+  int height() const { return m_Height; }
+  const Imath::V2s coord(int i, int j) const
+  {
+    size_t c = (i + size_t(j) * m_Width) * 2;
+    return Imath::V2s(m_Coords[c], m_Coords[c + 1]);
+  }
+};
+
+#endif // _COORDINATEMAP_H__
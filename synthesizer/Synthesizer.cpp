@@ -1,5 +1,6 @@
 #include <float.h>
 #include <assert.h>
+#include <algorithm>
 #include <tbb/tbb.h>
 
 #include "Synthesizer.h"
@@ -9,38 +10,149 @@ using namespace tbb;
 
 // --------------------------------------------------------------
 
-Synthesizer::Synthesizer(Analyzer& a) : m_Analyzer(a)
+Synthesizer::Synthesizer(std::shared_ptr<const Analyzer> a)
+  : m_Analyzer(a), m_Back(NULL), m_Retained(0), m_Candidates(K), m_Batched(true), m_Rows(0), m_Band(0), m_Bands(1), m_Exchange(NULL), m_Uncorrected(false)
 {
+  setCorrectionPasses(0.0f, 2, 2);
+}
+
+// --------------------------------------------------------------
 
+Synthesizer::SynthesisData* Synthesizer::newLevel(int rows, int columns, int firstRow)
+{
+  typedef SynthesisData::extent_range range;
+  return new SynthesisData(boost::extents[range(firstRow - Apron, firstRow + rows + Apron)][range(-Apron, columns + Apron)]);
 }
 
 // --------------------------------------------------------------
 
-Synthesizer::~Synthesizer()
+void Synthesizer::wrapApron(SynthesisData& synthesis)
+{
+  int first  = firstRowOf(synthesis);
+  int row    = rowsOf(synthesis);
+  int column = columnsOf(synthesis);
+  bool band  = isBand(synthesis);
+  if (band) {
+    // ghost rows of a band are owned by the neighboring bands, only their
+    // ghost columns are wrapped below
+    m_Exchange->exchange(synthesis);
+  }
+  for (int j = first - Apron; j < first + row + Apron; ++j) {
+    bool ghost_row = (j < first || j >= first + row);
+    int  src_j     = band ? j : ImageStack::wrapAccess(j, row);
+    for (int i = -Apron; i < column + Apron; ++i) {
+      // skip interior pixels of interior rows
+      if (!ghost_row && i == 0) {
+        i = column - 1;
+        continue;
+      }
+      synthesis[j][i] = synthesis[src_j][ImageStack::wrapAccess(i, column)];
+    }
+  }
+}
+
+// --------------------------------------------------------------
+
+void Synthesizer::setBand(int band, int bands, HaloExchange* exchange)
 {
+  assert(m_Synthesized.empty());
+  assert(bands >= 1 && band >= 0 && band < bands && exchange != NULL);
+  m_Band     = band;
+  m_Bands    = bands;
+  m_Exchange = exchange;
+}
 
+// --------------------------------------------------------------
+
+void Synthesizer::bandOf(int rows, int& first, int& count) const
+{
+  // a level is split only if every band gets at least Apron rows, so that
+  // the apron of a band is always held by its direct neighbors
+  if (m_Exchange == NULL || rows < m_Bands * Apron) {
+    first = 0;
+    count = rows;
+    return;
+  }
+  first = int((long long)rows * m_Band / m_Bands);
+  count = int((long long)rows * (m_Band + 1) / m_Bands) - first;
 }
 
 // --------------------------------------------------------------
 
-void Synthesizer::init(uint w,uint h,float jitterStrength,float kappa, int subpasslevel)
+void Synthesizer::setCandidates(int candidates)
 {
-  assert(kappa > 0.0f);
+  assert(candidates >= 1 && candidates <= K);
+  m_Candidates = candidates;
+}
+
+// --------------------------------------------------------------
+
+void Synthesizer::setBatchedCorrection(bool batched)
+{
+  m_Batched = batched;
+}
+
+// --------------------------------------------------------------
+
+void Synthesizer::setRetainedLevels(int levels)
+{
+  assert(levels >= 0);
+  m_Retained = levels;
+  releaseLevels();
+}
+
+// --------------------------------------------------------------
+
+void Synthesizer::setCorrectionPasses(float changeThreshold, int minPasses, int maxPasses)
+{
+  assert(changeThreshold >= 0.0f && minPasses >= 0 && maxPasses >= minPasses);
+  m_ChangeThreshold = changeThreshold;
+  m_MinPasses       = minPasses;
+  m_MaxPasses       = maxPasses;
+}
+
+// --------------------------------------------------------------
+
+Synthesizer::~Synthesizer()
+{
+  for (size_t s = 0; s < m_Synthesized.size(); ++s) {
+    delete m_Synthesized[s];
+  }
+  delete m_Back;
+}
+
+// --------------------------------------------------------------
+
+void Synthesizer::init(uint w,uint h,float jitterStrength,float kappa, int subpasslevel, uint seed)
+{
+  assert(m_Synthesized.empty());
   // initialize coarsest level to obtain desired resolution at finest level
-  int nx = int(ceil(w / float(m_Analyzer.ex()->spec().width)));
-  int ny = int(ceil(h / float(m_Analyzer.ex()->spec().height)));
-  SynthesisData s_data(boost::extents[nx][ny]);
-  boost::multi_array_ref<Imath::V2s, 1> s_data_ref(s_data.data(), boost::extents[s_data.num_elements()]);
-  std::fill(s_data_ref.begin(), s_data_ref.end(), Imath::V2s(m_Analyzer.ex()->spec().width/2,m_Analyzer.ex()->spec().height/2));
+  int nx = int(ceil(w / float(m_Analyzer->ex()->spec().width)));
+  int ny = int(ceil(h / float(m_Analyzer->ex()->spec().height)));
+  SynthesisData* s_data = newLevel(ny, nx);
+  std::fill(s_data->data(), s_data->data() + s_data->num_elements(), Imath::V2s(m_Analyzer->ex()->spec().width/2,m_Analyzer->ex()->spec().height/2));
   
   m_Synthesized.push_back(s_data);
+  m_Rows = ny;
 
+  setup(jitterStrength, kappa, subpasslevel, seed);
+
+  // the first synthesis step corrects at the level below the start level
+  requestLevels(m_StartLevel - 1);
+}
+
+// --------------------------------------------------------------
+
+void Synthesizer::setup(float jitterStrength, float kappa, int subpasslevel, uint seed)
+{
+  assert(kappa > 0.0f);
   // init parameters
   m_Kappa          = kappa;
   m_JitterStrength = jitterStrength;
+  m_Seed           = seed;
 
   // start level is coarsest
-  m_StartLevel = m_Analyzer.stack()->numLevels() - 1;
+  m_StartLevel = m_Analyzer->stack()->numLevels() - 1;
   m_Subpasslevel = subpasslevel;
 
   assert(m_StartLevel > 0); // with current algorithm it makes no sense to start at level 0
@@ -48,6 +160,95 @@ void Synthesizer::init(uint w,uint h,float jitterStrength,float kappa, int subpa
 
 // --------------------------------------------------------------
 
+void Synthesizer::initFromPrevious(const SynthesisData& previous, int levels, const FlowField* flow,
+                                   float jitterStrength, float kappa, int subpasslevel, uint seed)
+{
+  int start_level = m_Analyzer->stack()->numLevels() - 1;
+  assert(m_Synthesized.empty());
+  assert(levels >= 0 && levels <= start_level);
+  int row    = rowsOf(previous);
+  int column = columnsOf(previous);
+  assert(row % (1 << levels) == 0 && column % (1 << levels) == 0);
+  assert(flow == NULL || (int(flow->shape()[0]) == row && int(flow->shape()[1]) == column));
+  int width  = m_Analyzer->ex()->spec().width;
+  int height = m_Analyzer->ex()->spec().height;
+
+  // The level 'levels' steps above the finest holds the coordinate of the
+  // first pixel of every block: upsampling it back regenerates coherent
+  // patches exactly, only patch boundaries get corrected again.
+  // the starting level is synthesized whole, in every band
+  m_Rows = row >> levels;
+  SynthesisData* s_data = newLevel(row >> levels, column >> levels);
+  for (int j = 0; j < (row >> levels); ++j) {
+    for (int i = 0; i < (column >> levels); ++i) {
+      int x = i << levels;
+      int y = j << levels;
+      if (flow != NULL) {
+        // backward advection, content at p comes from p - flow(p)
+        const Imath::V2f& f = (*flow)[y][x];
+        x = ImageStack::wrapAccess(x - int(floor(f[0] + 0.5f)), column);
+        y = ImageStack::wrapAccess(y - int(floor(f[1] + 0.5f)), row);
+      }
+      Imath::V2s xy = previous[y][x];
+      (*s_data)[j][i] = Imath::V2s(ImageStack::wrapAccess(xy[0], width), ImageStack::wrapAccess(xy[1], height));
+    }
+  }
+  wrapApron(*s_data);
+
+  // at the finest level, only the pixels whose footprint the flow did not
+  // move rigidly need correction; the others were corrected with the same
+  // neighborhood in the previous frame
+  m_Dirty.clear();
+  if (levels == 0) {
+    m_Dirty.assign(size_t(row) * column, 0);
+    if (flow != NULL) {
+      std::vector<Imath::V2i> shift(size_t(row) * column);
+      for (int j = 0; j < row; ++j) {
+        for (int i = 0; i < column; ++i) {
+          const Imath::V2f& f = (*flow)[j][i];
+          shift[size_t(j) * column + i] = Imath::V2i(int(floor(f[0] + 0.5f)), int(floor(f[1] + 0.5f)));
+        }
+      }
+      for (int j = 0; j < row; ++j) {
+        for (int i = 0; i < column; ++i) {
+          const Imath::V2i& s = shift[size_t(j) * column + i];
+          bool rigid = true;
+          for (int dj = -Apron; dj <= Apron && rigid; ++dj) {
+            for (int di = -Apron; di <= Apron && rigid; ++di) {
+              rigid = shift[size_t(ImageStack::wrapAccess(j + dj, row)) * column + ImageStack::wrapAccess(i + di, column)] == s;
+            }
+          }
+          m_Dirty[size_t(j) * column + i] = rigid ? 0 : 1;
+        }
+      }
+    }
+  }
+
+  // coarser steps are never synthesized for this frame
+  m_Synthesized.assign(start_level - levels, (SynthesisData*)NULL);
+  m_Synthesized.push_back(s_data);
+  // at the finest level already: the next step corrects s_data in place
+  m_Uncorrected = (levels == 0);
+
+  setup(jitterStrength, kappa, subpasslevel, seed);
+
+  requestLevels(std::max(levels - 1, 0));
+}
+
+// --------------------------------------------------------------
+
+void Synthesizer::requestLevels(int coarsest)
+{
+  // every stack level costs the same to analyze (they all have the exemplar
+  // resolution), so levels are analyzed side by side rather than one step
+  // ahead; coarser levels, never reached, are not analyzed at all
+  for (int l = coarsest; l >= 0; --l) {
+    m_Analyzer->requestLevel(l);
+  }
+}
+
+// --------------------------------------------------------------
+
 int Synthesizer::currentExemplarLevel()
 {
   // Compute exemplar level from number of synthesis steps (number of calls to synthesizeNextLevel)
@@ -63,7 +264,33 @@ bool Synthesizer::done()
   // Done if finest level has been reached.
   // This happens when the number of perfromed synthesis steps 
   // equals the exemplar level at which synthesis started.
-  return (m_Synthesized.size() == m_StartLevel+1);
+  return (m_Synthesized.size() == m_StartLevel+1) && !m_Uncorrected;
+}
+
+// --------------------------------------------------------------
+
+//! grows a row-major rows x columns mask by radius pixels, toroidally
+static void dilateMask(std::vector<unsigned char>& mask, int rows, int columns, int radius)
+{
+  std::vector<unsigned char> tmp(mask.size(), 0);
+  // horizontal, then vertical
+  for (int j = 0; j < rows; ++j) {
+    for (int i = 0; i < columns; ++i) {
+      if (!mask[size_t(j) * columns + i]) continue;
+      for (int d = -radius; d <= radius; ++d) {
+        tmp[size_t(j) * columns + ImageStack::wrapAccess(i + d, columns)] = 1;
+      }
+    }
+  }
+  std::fill(mask.begin(), mask.end(), 0);
+  for (int j = 0; j < rows; ++j) {
+    for (int i = 0; i < columns; ++i) {
+      if (!tmp[size_t(j) * columns + i]) continue;
+      for (int d = -radius; d <= radius; ++d) {
+        mask[size_t(ImageStack::wrapAccess(j + d, rows)) * columns + i] = 1;
+      }
+    }
+  }
 }
 
 // --------------------------------------------------------------
@@ -74,22 +301,70 @@ void Synthesizer::synthesizeNextLevel()
   // The new result is added to m_Synthesized
   assert(!done());
   assert(m_Synthesized.size() > 0);
-  // add the next level result
-
-  SynthesisData data(boost::extents[m_Synthesized.back().size() * 2][m_Synthesized.back()[0].size() * 2]);
-  m_Synthesized.push_back( data );
-  /// 1. upsample
-  upsample    ( m_Synthesized[m_Synthesized.size()-2] , m_Synthesized.back() );
-  /// 2. jitter
-  // adapt jitter strength per level - arbitrary, ideally should be per-level 
-  // user control. Overall it is often more desirable to add strong jitter at 
-  // coarser levels and let synthesis recover at finer resolution levels.
-  float strength = m_JitterStrength * (currentExemplarLevel() < 3 ? 0 : currentExemplarLevel()) / (float)m_Analyzer.stack()->numLevels()+1;
-  // apply jitter
-  jitter      ( strength , m_Synthesized.back() );
+  int columns;
+  if (m_Uncorrected) {
+    // the level set by initFromPrevious is only corrected
+    const SynthesisData& level = *m_Synthesized.back();
+    columns = columnsOf(level);
+    m_Back  = newLevel(rowsOf(level), columns, firstRowOf(level));
+    m_Uncorrected = false;
+  } else {
+    // add the next level result
+    const SynthesisData& parent = *m_Synthesized.back();
+    int rows = m_Rows * 2;
+    columns  = columnsOf(parent) * 2;
+    int first, count;
+    bandOf(rows, first, count);
+    m_Rows = rows;
+    m_Synthesized.push_back( newLevel(count, columns, first) );
+    // both correction buffers of the level are allocated once, up front
+    m_Back = newLevel(count, columns, first);
+    /// 1. upsample
+    upsample    ( parent , *m_Synthesized.back() );
+    /// 2. jitter
+    // adapt jitter strength per level - arbitrary, ideally should be per-level 
+    // user control. Overall it is often more desirable to add strong jitter at 
+    // coarser levels and let synthesis recover at finer resolution levels.
+    float strength = m_JitterStrength * (currentExemplarLevel() < 3 ? 0 : currentExemplarLevel()) / (float)m_Analyzer->stack()->numLevels()+1;
+    // apply jitter
+    jitter      ( strength , *m_Synthesized.back() );
+    wrapApron   ( *m_Synthesized.back() );
+  }
+  m_Analyzer->waitLevel(currentExemplarLevel());
   ///// 3. correct
-  for (int p = 0; p < 2; ++p) {
-    correction( m_Synthesized.back() );
+  // keep correcting until the result has converged, within the pass bounds
+  // a band decides on the changes of the whole level, as every other band does
+  long long pixel_count = (long long)m_Rows * columns;
+  int p = 0;
+  while (p < m_MaxPasses) {
+    long long changed = correction();
+    if (isBand(*m_Synthesized.back())) {
+      changed = m_Exchange->sum(changed);
+    }
+    if (!m_Dirty.empty()) {
+      // pixels changed by this pass alter the neighborhoods around them
+      dilateMask(m_Dirty, m_Rows, columns, Apron);
+    }
+    ++p;
+    if (p >= m_MinPasses && changed <= double(m_ChangeThreshold) * pixel_count) {
+      break;
+    }
+  }
+  m_PassCounts.push_back(p);
+  m_Dirty.clear();
+  delete m_Back;
+  m_Back = NULL;
+  releaseLevels();
+}
+
+// --------------------------------------------------------------
+
+void Synthesizer::releaseLevels()
+{
+  if (m_Retained == 0) return;
+  for (int s = 0; s + m_Retained < int(m_Synthesized.size()); ++s) {
+    delete m_Synthesized[s];
+    m_Synthesized[s] = NULL;
   }
 }
 
@@ -102,139 +377,265 @@ void Synthesizer::upsample(const SynthesisData& parent, SynthesisData& _child)
 
   int spacing = (1 << l);
   // next level has twice the resolution of the previous one
-  int row = parent.size();
-  int column = parent[0].size();
-  // coordinate inheritence
-  for (int j = 0; j < row; ++j) {
+  int first = firstRowOf(_child);
+  int row = rowsOf(_child);
+  int column = columnsOf(_child);
+  // coordinate inheritence - runs over child pixels, so that a band only
+  // reads the parent rows it holds (its own rows and apron)
+  for (int j = first; j < first + row; ++j) {
     for (int i = 0; i < column; ++i) {
-      //printf("i j = (%d,%d)\n", i, j);
-      for (int cj = 0; cj < 2; ++cj) {
-        for (int ci = 0; ci < 2; ++ci) {
-          _child[j*2 + cj][i*2 + ci] = parent[j][i] + Imath::V2s(ci,cj) * spacing;
-        }
-      }
+      _child[j][i] = parent[j/2][i/2] + Imath::V2s(i%2,j%2) * spacing;
     }
   }
 }
 
 // --------------------------------------------------------------
 
+//! mixes the bits of h (splitmix64 finalizer)
+static unsigned long long mixBits(unsigned long long h)
+{
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+//! random sample of a pixel, independent of the order in which pixels are
+//! visited and of which band of the level is synthesized
+static unsigned int jitterSample(unsigned int seed, int step, int j, int i)
+{
+  unsigned long long h = mixBits(seed);
+  h = mixBits(h ^ (unsigned int)step);
+  h = mixBits(h ^ (unsigned int)j);
+  h = mixBits(h ^ (unsigned int)i);
+  return (unsigned int)(h >> 32);
+}
+
+// --------------------------------------------------------------
+
 void Synthesizer::jitter(float strength, SynthesisData& synthesis)
 {
   // coordinate inheritence
-  boost::multi_array_ref<Imath::V2s, 1> synthesis_ref(synthesis.data(), boost::extents[synthesis.num_elements()]);
-  int pixel_count = synthesis_ref.num_elements();
-  for (int i = 0; i < pixel_count; ++i) {
-    float temp = (rand()%100000) / 100000.0f;
-    temp = (temp - 0.5f) * 2.0f;
-    synthesis_ref[i] = synthesis_ref[i] + Imath::V2s(short(strength*temp),short(strength*temp));
+  int step = int(m_Synthesized.size()) - 1;
+  int first = firstRowOf(synthesis);
+  int row = rowsOf(synthesis);
+  int column = columnsOf(synthesis);
+  for (int j = first; j < first + row; ++j) {
+    for (int i = 0; i < column; ++i) {
+      float temp = (jitterSample(m_Seed, step, j, i)%100000) / 100000.0f;
+      temp = (temp - 0.5f) * 2.0f;
+      synthesis[j][i] = synthesis[j][i] + Imath::V2s(short(strength*temp),short(strength*temp));
+    }
   }
 }
 
 // --------------------------------------------------------------
 
-void Synthesizer::correction(SynthesisData& synthesis)
+long long Synthesizer::correction()
 {
   // Performs one correction pass, made of four sub-passes
+  long long changed = 0;
   for (int i_row = 0; i_row < m_Subpasslevel; ++i_row) {
     for (int i_column = 0; i_column < m_Subpasslevel; ++i_column) {
       // apply correction sub-pass
-      correctionSubpass(Imath::V2s(i_column, i_row), synthesis);
+      changed += correctionSubpass(Imath::V2s(i_column, i_row));
     }
   }
+  return changed;
 }
 
 // --------------------------------------------------------------
 
-void Synthesizer::correctionSubpass(const Imath::V2s& subpass_index, SynthesisData& synthesis)
+long long Synthesizer::correctionSubpass(const Imath::V2s& subpass_index)
 {
-  // temporary copy of the buffer, all reads occur in _S, all writes in tmp
-  SynthesisData tmp = synthesis;
-  // _S is copied since only a quarter of the pixels are updated by sub-pass correction.
+  // all reads occur in the current level, all writes in the back buffer;
+  // rows are carried over, then the pixels of the sub-pass are corrected in
+  // batches of Lanes pixels. Pixels inside coherent patches are left out:
+  // correction keeps them anyway (see coherentAt), so the work concentrates
+  // on patch boundaries.
   // NOTE: Please see original publication for details on how to efficiently implement this 
   //       through pixel re-ordering.
+  const SynthesisData& synthesis = *m_Synthesized.back();
+  SynthesisData&       tmp       = *m_Back;
   int level = currentExemplarLevel();
-  const std::vector<Analyzer::KNearest>& nrst = m_Analyzer.kNrst()[level];
-  int pixel_count = synthesis.num_elements();
-  parallel_for( blocked_range<size_t>(0,pixel_count), 
-   [&](const blocked_range<size_t>& r) {
-    for(size_t i=r.begin(); i!=r.end(); ++i) 
-        Synthesizer::correctionSubpassForOne(i, level, subpass_index, this, nrst, synthesis, tmp); 
-  }
+  m_Analyzer->waitLevel(level);
+  int first  = firstRowOf(synthesis);
+  int column = columnsOf(synthesis);
+  int stride = m_Subpasslevel;
+  long long changed = parallel_reduce( blocked_range<int>(first, first + rowsOf(synthesis)), 0LL,
+   [&](const blocked_range<int>& r, long long n)->long long {
+    for(int j=r.begin(); j!=r.end(); ++j) {
+      std::copy(&synthesis[j][0], &synthesis[j][0] + column, &tmp[j][0]);
+      if ((j % stride) != subpass_index[1]) continue;
+      int columns[Lanes];
+      int count = 0;
+      for (int i = subpass_index[0]; i < column; i += stride) {
+        if (!m_Dirty.empty() && !m_Dirty[size_t(j) * column + i]) continue;
+        if (coherentAt(synthesis, i, j, level)) continue;
+        if (!m_Batched) {
+          n += Synthesizer::correctionSubpassForOne(j, i, level, this, synthesis, tmp) ? 1 : 0;
+          continue;
+        }
+        columns[count++] = i;
+        if (count == Lanes) {
+          n += Synthesizer::correctionSubpassForBatch(j, columns, count, level, this, synthesis, tmp);
+          count = 0;
+        }
+      }
+      if (count > 0) {
+        n += Synthesizer::correctionSubpassForBatch(j, columns, count, level, this, synthesis, tmp);
+      }
+    }
+    return n;
+  },
+  std::plus<long long>()
   );
-  // done, store result
-  synthesis = tmp;
+  // done, the back buffer becomes the current level
+  std::swap(m_Synthesized.back(), m_Back);
+  wrapApron(*m_Synthesized.back());
+  return changed;
 }
 
 // --------------------------------------------------------------
 
-void Synthesizer::correctionSubpassForOne(int pixel_index, int level,
-                                            const Imath::V2s& subpass_index,
-                                            const Synthesizer* theSynthesizer,
-                                            const std::vector<Analyzer::KNearest>& nrst,
-                                            const SynthesisData& synthesis,
-                                            SynthesisData& synthesis_out)
+int Synthesizer::correctionSubpassForBatch(int i_row, const int* columns, int count, int level,
+                                           const Synthesizer* theSynthesizer,
+                                           const SynthesisData& synthesis,
+                                           SynthesisData& synthesis_out)
 {
-  int column = synthesis[0].size();
-  int row = synthesis.size();
-  int i_column = pixel_index % column;
-  int i_row = pixel_index / column;
-
-  //sub-pass mechanism
-  if ((i_column % theSynthesizer->m_Subpasslevel) != subpass_index[0] ||
-      (i_row % theSynthesizer->m_Subpasslevel) != subpass_index[1] )
-        return;
-
+  assert(count >= 1 && count <= Lanes);
+  const int E      = DIM * VN; // values per neighborhood
   int spacing = (1 << level);
-  const int numCand = 9*K+1;
-  Imath::V2s kcand[numCand];
-  // non-coherent candidates stored in [0 ; (9*K-1)], coherent candidates in [9*K ; 9*(K+1)], self in last
+  // only the first C of the K nearest neighbors are used (see setCandidates)
+  const int C = theSynthesizer->m_Candidates;
+  const int numCand = 9*C+1;
+  Imath::V2s kcand[Lanes][9*K+1];
+  // non-coherent candidates stored in [0 ; (9*C-1)], coherent candidates in [9*C ; 9*(C+1)], self in last
   // it is important to put coherent candidates last so that they are chosen in case of tie
   // ties happen constantly in coherent patches
+  // Per-lane arrays are element-major ([element][lane]), so that the loops
+  // over lanes below map to vector instructions.
+  float syN[DIM * VN][Lanes];
+  float exN[DIM * VN][Lanes];
+  memset(exN, 0, sizeof(exN)); // lanes past count stay defined
+  for (int lane = 0; lane < count; ++lane) {
+    int x = columns[lane];
+    /// Gather candidates
+    // for each neighbor around the pixel (9 of them, including center)
+    for (int nj = -1; nj < 2; nj = nj+1) {
+      for (int ni = -1; ni < 2; ni = ni+1) {
+        int nid = (ni+1)+(nj+1)*3;
+        // the apron makes neighbors directly addressable
+        Imath::V2s n = synthesis[i_row + nj][x + ni];
+        // n is a coordinate in exemplar stack
+        // delta must be multiplied by stack level offset
+        const Analyzer::KNearest& nrst = theSynthesizer->m_Analyzer->kNearestAt(level, n[0], n[1]);
+        for (int k = 0; k < C; ++k) {
+          Imath::V2s c = nrst.coords[k] - Imath::V2s(ni,nj) * spacing;
+          if (k > 0) {
+            kcand[lane][nid*(C-1) + (k - 1)] = c; // non-coherent candidate
+          } else {
+            kcand[lane][  9*(C-1) + nid] = c; // coherent candidate - we want them to be treated separately in case of tie
+          }
+        }
+      }
+    }
+    kcand[lane][numCand-1] = synthesis[i_row][x]; // self as last -- VERY IMPORTANT to ensure identity in coherent patches --
+
+    /// Gather current neighborhood in synthesized texture
+    Analyzer::Neighborhood n = theSynthesizer->gatherNeighborhood(int(theSynthesizer->m_Synthesized.size())-1, x, i_row);
+    for (int e = 0; e < E; ++e) {
+      syN[e][lane] = n.values()[e];
+    }
+  }
+  for (int lane = count; lane < Lanes; ++lane) {
+    for (int e = 0; e < E; ++e) {
+      syN[e][lane] = 0.0f;
+    }
+  }
+
+  /// Find best matching candidate, in all lanes at once
+  float mind[Lanes];
+  int   best[Lanes];
+  for (int lane = 0; lane < Lanes; ++lane) {
+    mind[lane] = FLT_MAX;
+    best[lane] = numCand-1;
+  }
+  for (int k = 0; k < numCand; ++k) {
+    for (int lane = 0; lane < count; ++lane) {
+      const float* ex = theSynthesizer->m_Analyzer->neighborhoodAt(level, kcand[lane][k][0], kcand[lane][k][1]).values();
+      for (int e = 0; e < E; ++e) {
+        exN[e][lane] = ex[e];
+      }
+    }
+    // compare - same accumulation order as Neighborhood::sqLength, lane by lane
+    float d[Lanes];
+    for (int lane = 0; lane < Lanes; ++lane) {
+      d[lane] = 0.0f;
+    }
+    for (int e = 0; e < E; ++e) {
+      for (int lane = 0; lane < Lanes; ++lane) {
+        d[lane] += pow(exN[e][lane] - syN[e][lane], 2.0f);
+      }
+    }
+    float weight = (k >= 9*(C-1)) ? theSynthesizer->m_Kappa : 1.0f; // favor (or defavor) coherent candidates
+    // masked min-reduction: lanes whose distance does not improve keep their best
+    for (int lane = 0; lane < Lanes; ++lane) {
+      float dk  = d[lane] * weight;
+      bool take = dk <= mind[lane];
+      mind[lane] = take ? dk : mind[lane];
+      best[lane] = take ? k  : best[lane];
+    }
+  }
+  // replace in output
+  int changed = 0;
+  for (int lane = 0; lane < count; ++lane) {
+    int x = columns[lane];
+    synthesis_out[i_row][x] = kcand[lane][best[lane]];
+    changed += (kcand[lane][best[lane]] != synthesis[i_row][x]) ? 1 : 0;
+  }
+  return changed;
+}
+
+// --------------------------------------------------------------
+
+bool Synthesizer::correctionSubpassForOne(int i_row, int i_column, int level,
+                                          const Synthesizer* theSynthesizer,
+                                          const SynthesisData& synthesis,
+                                          SynthesisData& synthesis_out)
+{
+  int spacing = (1 << level);
+  // same candidate order as correctionSubpassForBatch
+  const int C = theSynthesizer->m_Candidates;
+  const int numCand = 9*C+1;
+  Imath::V2s kcand[9*K+1];
   /// Gather candidates
-  // for each neighbor around the pixel (9 of them, including center)
   for (int nj = -1; nj < 2; nj = nj+1) {
     for (int ni = -1; ni < 2; ni = ni+1) {
       int nid = (ni+1)+(nj+1)*3;
-      for (int k = 0; k < K; ++k) {
-        int x = ImageStack::wrapAccess(i_column + ni, column);
-        int y = ImageStack::wrapAccess(i_row + nj, row);
-        Imath::V2s n = synthesis[y][x];
-        // n is a coordinate in exemplar stack
-        // delta must be multiplied by stack level offset
-        int kn_length_2 = nrst.size();
-        int kn_length = sqrt(kn_length_2);
-        n[0] = ImageStack::wrapAccess(n[0], kn_length);
-        n[1] = ImageStack::wrapAccess(n[1], kn_length);
-        //if(kNrst[n[0] + n[1] * kn_length].coords[k][0] == -1)
-        //  break;
-        Imath::V2s c = nrst[n[0] + n[1] * kn_length].coords[k] - Imath::V2s(ni,nj) * spacing;
+      Imath::V2s n = synthesis[i_row + nj][i_column + ni];
+      const Analyzer::KNearest& nrst = theSynthesizer->m_Analyzer->kNearestAt(level, n[0], n[1]);
+      for (int k = 0; k < C; ++k) {
+        Imath::V2s c = nrst.coords[k] - Imath::V2s(ni,nj) * spacing;
         if (k > 0) {
-          //int index = nid*(K-1) + (k - 1);
-          //printf("k = %d index = %d\n", k , index);
-          kcand[nid*(K-1) + (k - 1)] = c; // non-coherent candidate
+          kcand[nid*(C-1) + (k - 1)] = c; // non-coherent candidate
         } else {
-          //int index = 9*(K-1) + nid;
-          //printf("k = %d index = %d\n", k , index);
-          kcand[  9*(K-1) + nid] = c; // coherent candidate - we want them to be treated separately in case of tie
+          kcand[  9*(C-1) + nid] = c; // coherent candidate
         }
       }
     }
   }
-  kcand[numCand-1] = synthesis[i_row][i_column]; // self as last -- VERY IMPORTANT to ensure identity in coherent patches --
+  kcand[numCand-1] = synthesis[i_row][i_column]; // self as last
 
   /// Gather current neighborhood in synthesized texture
   Analyzer::Neighborhood syN = theSynthesizer->gatherNeighborhood(int(theSynthesizer->m_Synthesized.size())-1, i_column, i_row);
-
   /// Find best matching candidate
   float mind = FLT_MAX;
   Imath::V2s best = synthesis[i_row][i_column];
-
   for (int k = 0; k < numCand; ++k) {
-    const Analyzer::Neighborhood& exN = theSynthesizer->m_Analyzer.neighborhoodAt(level, kcand[k][0], kcand[k][1]);
+    const Analyzer::Neighborhood& exN = theSynthesizer->m_Analyzer->neighborhoodAt(level, kcand[k][0], kcand[k][1]);
     // compare
     float d = ( exN - syN ).sqLength();
-    if (k >= 9*(K-1)) {
+    if (k >= 9*(C-1)) {
       d = d * theSynthesizer->m_Kappa; // favor (or defavor) coherent candidates
     }
     if (d <= mind) {
@@ -244,6 +645,7 @@ void Synthesizer::correctionSubpassForOne(int pixel_index, int level,
   }
   // replace in output
   synthesis_out[i_row][i_column] = best;
+  return best != synthesis[i_row][i_column];
 }
 
 // --------------------------------------------------------------
@@ -253,22 +655,14 @@ Analyzer::Neighborhood Synthesizer::gatherNeighborhood(int step,int i,int j) con
   // Gather a neighborhood in the current synthesis result
   Analyzer::Neighborhood n;
   assert(step>=0 && step<int(m_Synthesized.size()));
-  assert(m_Synthesized[step].size()>0);
+  assert(m_Synthesized[step] != NULL);
+  const SynthesisData& synthesis = *m_Synthesized[step];
   int l = m_StartLevel - step;
-  assert(l>=0 && l<int(m_Analyzer.stack()->numLevels()));
-  const ImageBuf* stackLevel = m_Analyzer.stack()->level(l);
-  int column = m_Synthesized[step][0].size();
-  int row = m_Synthesized[step].size();
-  int width = stackLevel->spec().width;
+  assert(l>=0 && l<int(m_Analyzer->stack()->numLevels()));
+  // the footprint lies within the apron, no wrap needed on the synthesis side
   Analyzer::Neighborhood::ForNeighborhood([&](int di, int dj, int index)->void {
-      int x  = (i + di);
-      int y  = (j + dj);
-      x = ImageStack::wrapAccess(x, column);
-      y = ImageStack::wrapAccess(y, row);
-      Imath::V2s s = m_Synthesized[step][y][x];  //   S[p]  (coordinate in exemplar stack)
-      float clr[DIM];
-      stackLevel->getpixel(s[0], s[1], clr);
-      n.setPixel(index, clr);
+      Imath::V2s s = synthesis[j + dj][i + di];  //   S[p]  (coordinate in exemplar stack)
+      n.setPixel(index, m_Analyzer->stackPixel(l, s[0], s[1]));
     }
   );
   return n;
@@ -276,19 +670,54 @@ Analyzer::Neighborhood Synthesizer::gatherNeighborhood(int step,int i,int j) con
 
 // --------------------------------------------------------------
 
+bool Synthesizer::coherentAt(const SynthesisData& synthesis, int i, int j, int level) const
+{
+  // Every footprint pixel then reads the exemplar exactly where the exemplar
+  // neighborhood of the pixel's own coordinate does: that candidate (self) has
+  // a distance of 0 and, being the last one, wins all ties. Correction would
+  // keep the pixel unchanged.
+  static std::vector<Imath::V2s> footprint;
+  static std::once_flag          footprint_once;
+  std::call_once(footprint_once, []() {
+    Analyzer::Neighborhood::ForNeighborhood([&](int di, int dj, int)->void {
+        footprint.push_back(Imath::V2s(di, dj));
+      }
+    );
+  });
+  int spacing = (1 << level);
+  int width   = m_Analyzer->stack()->level(level)->spec().width;
+  int height  = m_Analyzer->stack()->level(level)->spec().height;
+  Imath::V2s s = synthesis[j][i];
+  for (size_t f = 0; f < footprint.size(); ++f) {
+    const Imath::V2s& d = footprint[f];
+    Imath::V2s n = synthesis[j + d[1]][i + d[0]];
+    if (ImageStack::wrapAccess(n[0] - s[0] - d[0] * spacing, width)  != 0 ||
+        ImageStack::wrapAccess(n[1] - s[1] - d[1] * spacing, height) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// --------------------------------------------------------------
+
 ImageBuf* Synthesizer::colorize(int step)
 {
   // Create color version of the synthesis result (which contains coordinates only)
   assert(step < int(m_Synthesized.size()));
-  const ImageBuf* src = ((m_StartLevel-step) == 0) ? m_Analyzer.ex() : m_Analyzer.stack()->level(m_StartLevel-step);
+  assert(m_Synthesized[step] != NULL); // level was released, see setRetainedLevels
+  const SynthesisData& synthesis = *m_Synthesized[step];
+  const ImageBuf* src = ((m_StartLevel-step) == 0) ? m_Analyzer->ex() : m_Analyzer->stack()->level(m_StartLevel-step);
   int width = src->spec().width;
-  int row = m_Synthesized[step].size();
-  int column = m_Synthesized[step][0].size();
+  int first = firstRowOf(synthesis);
+  int row = rowsOf(synthesis);
+  int column = columnsOf(synthesis);
   ImageSpec specOutput(column, row, 3, TypeDesc::FLOAT);
+  specOutput.y = first; // the data window of a band starts at its first row
   ImageBuf* img = new ImageBuf(specOutput);
-  for (int j = 0; j < row; ++j) {
+  for (int j = first; j < first + row; ++j) {
     for (int i = 0; i < column; ++i) {
-      Imath::V2s xy = m_Synthesized[step][j][i];
+      Imath::V2s xy = synthesis[j][i];
       xy[0] = ImageStack::wrapAccess(xy[0], width);
       xy[1] = ImageStack::wrapAccess(xy[1], width);
       float clr[3];
@@ -309,19 +738,80 @@ ImageBuf* Synthesizer::result()
 
 // --------------------------------------------------------------
 
+//! 2x2 box reduction with wrap-around, used below the coarsest synthesis step
+static ImageBuf* reduce(const ImageBuf* src)
+{
+  int width  = src->spec().width;
+  int height = src->spec().height;
+  int nc     = src->spec().nchannels;
+  ImageSpec specOutput(std::max(1, width/2), std::max(1, height/2), nc, TypeDesc::FLOAT);
+  ImageBuf* img = new ImageBuf(specOutput);
+  for (int j = 0; j < specOutput.height; ++j) {
+    for (int i = 0; i < specOutput.width; ++i) {
+      float sum[3] = {0.0f, 0.0f, 0.0f};
+      for (int cj = 0; cj < 2; ++cj) {
+        for (int ci = 0; ci < 2; ++ci) {
+          float clr[3];
+          src->getpixel(ImageStack::wrapAccess(i*2 + ci, width), ImageStack::wrapAccess(j*2 + cj, height), clr);
+          for (int c = 0; c < 3; ++c) sum[c] += clr[c] * 0.25f;
+        }
+      }
+      img->setpixel(i, j, sum);
+    }
+  }
+  return img;
+}
+
+// --------------------------------------------------------------
+
+std::vector<ImageBuf*> Synthesizer::resultMipChain()
+{
+  // Mip level m of the result has the resolution of synthesis step (last - m),
+  // and that step is colorized from exemplar stack level m, which is already
+  // filtered to the matching footprint.
+  assert(m_Exchange == NULL); // the chain of a band is not defined
+  int finest = int(m_Synthesized.size())-1;
+  int width  = columnsOf(*m_Synthesized.back());
+  int height = rowsOf(*m_Synthesized.back());
+  int count  = 1;
+  while ((width >> count) > 0 || (height >> count) > 0) {
+    ++count;
+  }
+  int from_pyramid = 0;
+  while (from_pyramid < count && from_pyramid <= finest && m_Synthesized[finest - from_pyramid] != NULL) {
+    ++from_pyramid;
+  }
+  std::vector<ImageBuf*> chain(count, (ImageBuf*)NULL);
+  parallel_for( blocked_range<size_t>(0,from_pyramid), 
+    [&](const blocked_range<size_t>& r) {
+      for(size_t m=r.begin(); m!=r.end(); ++m) 
+        chain[m] = colorize(finest - m);
+    }
+  );
+  for (int m = from_pyramid; m < count; ++m) {
+    chain[m] = reduce(chain[m-1]);
+  }
+  return chain;
+}
+
+// --------------------------------------------------------------
+
 ImageBuf* Synthesizer::resultPatches()
 {
   // Color-code patches produced through synthesis. For visulization purposes only.
   int spacing = (1 << currentExemplarLevel());
-  const ImageBuf* src = m_Analyzer.stack()->level(0);
+  const ImageBuf* src = m_Analyzer->stack()->level(0);
   int width = src->spec().width;
-  int row = m_Synthesized.back().size();
-  int column = m_Synthesized.back()[0].size();
+  const SynthesisData& synthesis = *m_Synthesized.back();
+  int first = firstRowOf(synthesis);
+  int row = rowsOf(synthesis);
+  int column = columnsOf(synthesis);
   ImageSpec specOutput(column, row, 3, TypeDesc::FLOAT);
+  specOutput.y = first;
   ImageBuf* img = new ImageBuf(specOutput);
-  for (int j = 0; j < row; ++j) {
+  for (int j = first; j < first + row; ++j) {
     for (int i = 0; i < column; ++i) {
-      Imath::V2s xy = m_Synthesized.back()[j][i];
+      Imath::V2s xy = synthesis[j][i];
       img->setpixel(i, j, Imath::V3f((xy[0]%width)/float(width), (xy[1] % width)/float(width), 0.0f).getValue());
     }
   }
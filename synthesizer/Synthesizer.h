@@ -4,26 +4,66 @@
 #include <boost/multi_array.hpp>
 #include "../analyzer/Analyzer.h"
 
+class HaloExchange;
+
 class Synthesizer
 {
 public:
   typedef boost::multi_array<Imath::V2s,2> SynthesisData;
+  //! per-pixel displacement, in pixels of the finest level, indexed [row][column]
+  typedef boost::multi_array<Imath::V2f,2> FlowField;
+
+  //! Every SynthesisData level carries a toroidal ghost border of Apron pixels,
+  //! the width of the neighborhood footprint: valid indices are [-Apron, n+Apron),
+  //! the level itself is [0, n). Neighborhood fetches therefore never wrap.
+  static const int Apron = 2;
+  static int rowsOf   (const SynthesisData& s) { return int(s.shape()[0]) - 2*Apron; }
+  static int columnsOf(const SynthesisData& s) { return int(s.shape()[1]) - 2*Apron; }
+  //! first row of a level; rows are indexed globally, so a band (see setBand) starts past 0
+  static int firstRowOf(const SynthesisData& s) { return int(s.index_bases()[0]) + Apron; }
 
-  //! correctionSubpassInRegion processes pixels of a sub-region of the synthesized image
-  static void correctionSubpassForOne(int pixel_index, int level,
-                                      const Imath::V2s& subpass_index,
+  //! number of pixels corrected together by correctionSubpassForBatch, one per vector lane
+  static const int Lanes = 8;
+
+  //! correctionSubpassForBatch corrects count (at most Lanes) pixels of row i_row,
+  //! at the given columns, all belonging to the same sub-pass.
+  //! Candidate neighborhoods are gathered lane by lane, distances and the best
+  //! candidate selection are then computed for all lanes at once.
+  //! returns the number of pixels that were assigned a different coordinate
+  static int  correctionSubpassForBatch(int i_row, const int* columns, int count, int level,
+                                        const Synthesizer* theSynthesizer,
+                                        const SynthesisData& synthesis,
+                                        SynthesisData& synthesis_out);
+  //! correctionSubpassForOne corrects the pixel at column i_column of row i_row
+  //! alone; it is the scalar reference for correctionSubpassForBatch, same result.
+  //! returns true if the pixel was assigned a different coordinate
+  static bool correctionSubpassForOne(int i_row, int i_column, int level,
                                       const Synthesizer* theSynthesizer,
-                                      const std::vector<Analyzer::KNearest>& nrst,
                                       const SynthesisData& synthesis,
                                       SynthesisData& synthesis_out);
 private:
 
-  Analyzer&                             m_Analyzer;       // Analyzer holding exemplar data
-  std::vector<SynthesisData>            m_Synthesized;    // The number of entries correspond to the number of upsampling steps applied
+  std::shared_ptr<const Analyzer>       m_Analyzer;       // Analyzer holding exemplar data, shared read-only with other synthesizers
+  std::vector<SynthesisData*>           m_Synthesized;    // The number of entries correspond to the number of upsampling steps applied; NULL once released
+  SynthesisData*                        m_Back;           // Write buffer of the current level, swapped with m_Synthesized.back() after each sub-pass
+  int                                   m_Retained;       // Number of most recent levels kept in memory, 0 keeps all
+  int                                   m_Candidates;     // Number of k-nearest candidates used per neighbor, at most K
+  bool                                  m_Batched;        // Corrects pixels in batches of Lanes, or one at a time (see setBatchedCorrection)
   int                                   m_StartLevel;     // Exemplar statck level at which synthesis was started
   float                                 m_Kappa;          // Controls whether coherent candidates are favored; 1.0 has no effect, 0.1 has strong effect, 0.0 is invalid.
   float                                 m_JitterStrength; // Controls jitter strength. 
   int                                   m_Subpasslevel;
+  unsigned int                          m_Seed;           // Jitter seed; jitter is hashed from seed, step and pixel so that any band reproduces it
+  int                                   m_Rows;           // Rows of the whole current level, more than the synthesized ones for a band
+  int                                   m_Band;           // Index of the band of rows synthesized, out of m_Bands (see setBand)
+  int                                   m_Bands;
+  HaloExchange*                         m_Exchange;       // Transport to the neighboring bands, NULL for a whole-domain synthesis
+  bool                                  m_Uncorrected;    // The last level is set up but not corrected yet (initFromPrevious with levels = 0)
+  std::vector<unsigned char>            m_Dirty;          // Row-major mask of the pixels of such a level still to be corrected, empty corrects all
+  int                                   m_MinPasses;      // Correction passes always applied per level
+  int                                   m_MaxPasses;      // Correction passes never exceeded per level
+  float                                 m_ChangeThreshold;// Stop correcting once a pass changes less than this fraction of the pixels
+  std::vector<int>                      m_PassCounts;     // Correction passes applied at each synthesis step
 
   /**
   The three main steps of the algorithm
@@ -32,21 +72,39 @@ private:
   void upsample                 (const SynthesisData& parent, SynthesisData& _child);
   //! adds jitter
   void jitter                   (float strength, SynthesisData& synthesis);
-  //! correct neighborhoods to ensure result is visually similar to exemplar
-  void correction               (SynthesisData& synthesis);
+  //! correct neighborhoods of the current level to ensure result is visually similar to exemplar
+  //! returns the number of pixels whose coordinate changed
+  long long correction          ();
 
   /**
   Sub-pass mechanism
   */
   //! correctionSubpass processes pixels in an interleaved pattern aligned with ci,cj
-  //! m_NumThreads are created, each calling correctionSubpassInRegion
-  void correctionSubpass        (const Imath::V2s& index, SynthesisData& synthesis);
+  //! reads from the current level, writes into m_Back, then swaps the two
+  long long correctionSubpass   (const Imath::V2s& index);
+  //! sets the synthesis parameters common to init and initFromPrevious
+  void setup                    (float jitterStrength, float kappa, int subpasslevel, unsigned int seed);
+  //! frees levels that fall out of the retention window
+  void releaseLevels            ();
+  //! starts analysis of the exemplar levels coarsest..0, those the synthesis steps correct at
+  void requestLevels            (int coarsest);
+  //! allocates a rows x columns level with its apron, starting at row firstRow
+  static SynthesisData* newLevel(int rows, int columns, int firstRow = 0);
+  //! refreshes the apron of a level from the opposite borders, or from the
+  //! neighboring bands for the rows of a band
+  void wrapApron                (SynthesisData& synthesis);
+  //! rows [first, first+count) of a level with 'rows' rows synthesized here
+  void bandOf                   (int rows, int& first, int& count) const;
+  //! true if the level holds only a band of the rows of the current level
+  bool isBand                   (const SynthesisData& synthesis) const { return rowsOf(synthesis) != m_Rows; }
  
 /**
   Helper methods
   */
   //! gather a neighborhood in the current synthesis result
   Analyzer::Neighborhood gatherNeighborhood(int step,int i,int j) const; 
+  //! true if the neighborhood footprint of pixel i,j is a single exemplar patch
+  bool coherentAt(const SynthesisData& synthesis, int i, int j, int level) const;
   //! returns the exemplar level that must be used at the current synthesis step
   int  currentExemplarLevel();
   //! colorizes current synthesis result (synthesis results are made of exemplar pixel coordinates)
@@ -54,10 +112,14 @@ private:
 
 public:
   /**
-  Constructor - an analyzer must be given since it holds pre-computed data on the exemplar
+  Constructor - an analyzer must be given since it holds pre-computed data on the exemplar.
+  The analyzer may be shared by synthesizers running concurrently; all other
+  state, including the jitter generator, is private to each synthesizer.
   */
-  Synthesizer(Analyzer& a);
+  Synthesizer(std::shared_ptr<const Analyzer> a);
   ~Synthesizer();
+  Synthesizer(const Synthesizer&) = delete;
+  Synthesizer& operator=(const Synthesizer&) = delete;
 
   /**
   Initializes synthesis - call first!
@@ -65,7 +127,69 @@ public:
   w,h is the resolution of the top-most level of the pyramid
   It is equivalent to the number of times the exemplar will appear along each axis 
   */
-  void         init(unsigned int w = 512, unsigned int h = 512, float jitterStrength = 25.0f, float kappa = 1.0f, int subpasslevel = 2); 
+  void         init(unsigned int w = 512, unsigned int h = 512, float jitterStrength = 25.0f, float kappa = 1.0f, int subpasslevel = 2, unsigned int seed = 1); 
+
+  /**
+  Initializes synthesis of an animation frame from the previous frame - call
+  instead of init.
+
+  previous is the previous frame result (see resultCoords). It is advected by
+  flow (if given), then subsampled 'levels' steps above the finest level;
+  only those last 'levels' synthesis steps are run. Coherent patches are
+  reproduced exactly by upsampling, so frames stay temporally coherent, and
+  correction only visits pixels near patch boundaries (see coherentAt): the
+  cost of a frame depends on the patch size of the result. Little or no
+  jitter is expected here.
+
+  With levels = 0, the advected field itself is the finest level: the single
+  synthesis step left only corrects it, without upsampling or jitter. A pixel
+  whose whole footprint moved by the same whole number of pixels keeps the
+  neighborhood it was corrected with in the previous frame, so correction
+  starts from the pixels where the flow is not locally rigid, and each pass
+  extends to the footprint of the pixels it may have changed. A frame then
+  costs in proportion to the deformation of the flow.
+  */
+  void         initFromPrevious(const SynthesisData& previous, int levels = 2, const FlowField* flow = NULL,
+                                float jitterStrength = 0.0f, float kappa = 1.0f, int subpasslevel = 2, unsigned int seed = 1);
+
+  /**
+  Controls the number of correction passes per level. Passes stop as soon as
+  one changes less than changeThreshold of the pixels (after minPasses), and
+  never exceed maxPasses. The default (0, 2, 2) always applies two passes.
+  */
+  void         setCorrectionPasses(float changeThreshold, int minPasses, int maxPasses);
+
+  /**
+  Only the last 'levels' synthesis results are kept in memory, coarser ones are
+  freed as synthesis progresses. 0 (default) keeps every level.
+  */
+  void         setRetainedLevels(int levels);
+
+  /**
+  Uses only the first 'candidates' (1..K) nearest neighborhoods of each
+  neighbor during correction. Defaults to K.
+  */
+  void         setCandidates(int candidates);
+
+  /**
+  Selects the correction kernel: batches of Lanes pixels (default) or one
+  pixel at a time. Both produce the same result; the per-pixel kernel is the
+  reference the batched one is timed against (texsyn --bench-kernel).
+  */
+  void         setBatchedCorrection(bool batched);
+
+  /**
+  Distributed synthesis - call before init.
+
+  Only band 'band' out of 'bands' horizontal bands of rows of every level is
+  synthesized and kept in memory; levels too small to be split (fewer than
+  Apron rows per band) are synthesized whole. After each sub-pass, the apron
+  rows of the band are refreshed through 'exchange' from the neighboring
+  bands, and pass decisions use the pixel changes summed over all bands, so
+  that the union of the bands is identical to a whole-domain synthesis with
+  the same parameters. See distributed/TileCoordinator.h.
+  */
+  void         setBand(int band, int bands, HaloExchange* exchange);
 
   /**
   Synthesizes the next level of the multi-resolution pyramid.
@@ -80,8 +204,34 @@ public:
   
   //! returns current result
   ImageBuf* result();
+  //! returns the full mip chain of the current result, finest first, down to 1x1.
+  //! Levels matching retained synthesis steps are colorized from the pyramid
+  //! in parallel, the remaining ones are box-reduced from the previous level.
+  std::vector<ImageBuf*> resultMipChain();
   //! returns color-coded patches for the current result
   ImageBuf* resultPatches();
+  //! returns the number of correction passes applied at each synthesis step so far
+  const std::vector<int>& passCounts() const { return m_PassCounts; }
+  //! returns the exemplar coordinates of the current result
+  const SynthesisData& resultCoords() const { return *m_Synthesized.back(); }
+  //! returns the number of rows of the whole current level, of which a band holds a part
+  int levelRows() const { return m_Rows; }
+};
+
+/**
+Transport between the bands of a distributed synthesis (see Synthesizer::setBand).
+Every band calls the methods in the same order.
+*/
+class HaloExchange
+{
+public:
+  virtual ~HaloExchange() {}
+  //! sends the first and last Apron rows of the band to the previous and next
+  //! bands, and fills the apron rows of the band with theirs (toroidally);
+  //! only columns [0, columnsOf(band)) are exchanged
+  virtual void exchange(Synthesizer::SynthesisData& band) = 0;
+  //! returns the sum of value over all bands
+  virtual long long sum(long long value) = 0;
 };
 
 #endif // _SYNTHESIZER_H__
\ No newline at end of file